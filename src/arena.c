@@ -0,0 +1,54 @@
+#include "arena.h"
+
+#include <stdalign.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size, used;
+	alignas(max_align_t) char data[];
+};
+
+void *arena_alloc(struct arena *arena, size_t size) {
+	struct arena_block *block = arena->blocks;
+	size_t block_size;
+	void *p;
+
+	// Keep every allocation aligned for any type
+	size = (size + alignof(max_align_t) - 1) & ~(alignof(max_align_t) - 1);
+
+	if (!block || block->size - block->used < size) {
+		block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+		block = malloc(sizeof(*block) + block_size);
+		if (!block)
+			return NULL;
+		block->size = block_size;
+		block->used = 0;
+		block->next = arena->blocks;
+		arena->blocks = block;
+	}
+	p = block->data + block->used;
+	block->used += size;
+	return p;
+}
+
+char *arena_strndup(struct arena *arena, const char *s, size_t len) {
+	char *copy = arena_alloc(arena, len + 1);
+
+	if (!copy)
+		return NULL;
+	memcpy(copy, s, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+void arena_free(struct arena *arena) {
+	struct arena_block *block, *next;
+
+	for (block = arena->blocks; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	arena->blocks = NULL;
+}
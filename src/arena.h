@@ -0,0 +1,35 @@
+#ifndef __W2G_ARENA_H
+#define __W2G_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for data which is all freed at once, such as the strings
+ * kept from a config file. Memory comes from blocks of ARENA_BLOCK_SIZE
+ * bytes, or larger ones for larger allocations.
+ */
+
+#define ARENA_BLOCK_SIZE 4096
+
+struct arena_block;
+
+struct arena {
+	struct arena_block *blocks; // Newest first
+};
+
+/*
+ * Returns NULL if out of memory
+ */
+void *arena_alloc(struct arena *arena, size_t size);
+
+/*
+ * Copy len bytes of s, adding a terminating null
+ */
+char *arena_strndup(struct arena *arena, const char *s, size_t len);
+
+/*
+ * Free everything allocated from the arena, which may then be used again
+ */
+void arena_free(struct arena *arena);
+
+#endif // __W2G_ARENA_H
@@ -0,0 +1,33 @@
+#include "axis.h"
+
+#include <stdlib.h>
+
+#define DEG(d) ((d) << AXIS_FRAC_BITS)
+
+/*
+ * atan(r) for r in [0, 1] with 15 fractional bits, using
+ * atan(r) ~= pi/4 r + 0.273 r (1 - r)
+ */
+static int32_t atan_unit(int32_t r) {
+	// 0.273 rad in degrees, with AXIS_FRAC_BITS fractional bits
+	const int32_t k = 4004;
+
+	return r * (DEG(45) + (k * (32768 - r) >> 15)) >> 15;
+}
+
+int32_t tilt_angle(int32_t y, int32_t x) {
+	int32_t ax = abs(x), ay = abs(y);
+	int32_t angle;
+
+	if (!ax && !ay)
+		return 0;
+
+	if (ax >= ay)
+		angle = atan_unit(((int64_t) ay << 15) / ax);
+	else
+		angle = DEG(90) - atan_unit(((int64_t) ax << 15) / ay);
+
+	if (x < 0)
+		angle = DEG(180) - angle;
+	return y < 0 ? -angle : angle;
+}
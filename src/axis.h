@@ -0,0 +1,81 @@
+#ifndef __W2G_AXIS_H
+#define __W2G_AXIS_H
+
+#include <stdint.h>
+
+#include "config.h"
+
+/*
+ * Filter chain for analog sources: low-pass, deadzone, scale, clamp and
+ * response curve. Source values are fixed point with AXIS_FRAC_BITS fractional
+ * bits. Nothing is allocated per sample.
+ */
+
+#define AXIS_FRAC_BITS 8
+
+struct axis_state {
+	int32_t filtered; // Low-pass output
+	int32_t value; // Last value written
+};
+
+/*
+ * Convert a source value to axis units, rounding to the nearest unit
+ */
+static inline int32_t axis_scale(const struct axis_entry *entry, int64_t x) {
+	return (x * entry->scale + (1 << (15 + AXIS_FRAC_BITS))) >> (16 + AXIS_FRAC_BITS);
+}
+
+static inline int32_t axis_clamp(const struct axis_entry *entry, int32_t x) {
+	if (x > entry->max)
+		return entry->max;
+	if (x < entry->min)
+		return entry->min;
+	return x;
+}
+
+/*
+ * Shape a value by the axis' response curve, interpolating between its points
+ */
+static inline int32_t axis_curve(const struct axis_entry *entry, int32_t value) {
+	uint32_t pos = (uint32_t) (value < 0 ? -value : value) * entry->curve_scale;
+	uint32_t i = pos >> 16;
+	int32_t out;
+
+	if (i >= CURVE_SIZE)
+		out = entry->curve[CURVE_SIZE];
+	else
+		out = entry->curve[i] + (((int64_t) (entry->curve[i + 1] - entry->curve[i])
+				* (pos & 0xffff)) >> 16);
+	return value < 0 ? -out : out;
+}
+
+/*
+ * Filter a sample and return the value of the axis
+ */
+static inline int32_t axis_filter(const struct axis_entry *entry, struct axis_state *state,
+		int32_t sample) {
+	int64_t x;
+
+	state->filtered += (sample - state->filtered) >> entry->smoothing;
+	x = state->filtered;
+
+	// The deadzone is cut out so the axis leaves it without a jump
+	if (x > entry->deadzone)
+		x -= entry->deadzone;
+	else if (x < -entry->deadzone)
+		x += entry->deadzone;
+	else
+		return 0;
+
+	if (entry->curve)
+		return axis_curve(entry, axis_clamp(entry, axis_scale(entry, x)));
+	return axis_clamp(entry, axis_scale(entry, x));
+}
+
+/*
+ * Angle of the vector (x, y) from the x axis, in degrees with AXIS_FRAC_BITS
+ * fractional bits. Accurate to about 0.25 degrees.
+ */
+int32_t tilt_angle(int32_t y, int32_t x);
+
+#endif // __W2G_AXIS_H
@@ -0,0 +1,133 @@
+#include "bench.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+// Sections in each keymap of the template
+#define BENCH_SECTIONS 4
+
+/*
+ * One keymap. Its number varies the name, ids and turbo, so no two are alike.
+ */
+static const char bench_template[] =
+	"; Synthetic keymap %u\n"
+	"\n"
+	"[All]\n"
+	"Name = Synthetic gamepad %u\n"
+	"Vendor = 0x%04x\n"
+	"Product = 0x%04x\n"
+	"KEY_HOME+KEY_A = BTN_TRIGGER_HAPPY1\n"
+	"KEY_HOME+KEY_B = BTN_TRIGGER_HAPPY2\n"
+	"KEY_A+KEY_B = BTN_C\n"
+	"\n"
+	"[None]\n"
+	"KEY_A = BTN_X\n"
+	"KEY_B = BTN_Y Turbo=%u\n"
+	"KEY_PLUS = BTN_START\n"
+	"KEY_MINUS = BTN_SELECT\n"
+	"KEY_ONE = BTN_A/50 /30 BTN_A+BTN_B/100 ; Macro\n"
+	"KEY_TWO = BTN_B\n"
+	"KEY_LEFT = ABS_HAT0Y\n"
+	"KEY_RIGHT = -ABS_HAT0Y\n"
+	"KEY_UP = -ABS_HAT0X\n"
+	"KEY_DOWN = ABS_HAT0X\n"
+	"ACCEL_ROLL = ABS_X Deadzone=3 Smoothing=2 Expo=0.5\n"
+	"ACCEL_PITCH = -ABS_Y Range=45 Curve=50:20,80:50\n"
+	"IR_X = REL_X Max=20 Cutoff=1.5 Beta=0.02 Predict=8\n"
+	"IR_Y = REL_Y Max=20\n"
+	"\n"
+	"[Nunchuk]\n"
+	"KEY_A = BTN_A\n"
+	"KEY_B = BTN_B\n"
+	"KEY_PLUS = BTN_START\n"
+	"KEY_MINUS = BTN_SELECT\n"
+	"KEY_ONE = BTN_TL\n"
+	"KEY_TWO = BTN_TR\n"
+	"KEY_C = BTN_X\n"
+	"KEY_Z = BTN_Y\n"
+	"NUNCHUK_X = ABS_X Center=2 Range=90\n"
+	"NUNCHUK_Y = -ABS_Y Center=-1 Range=90\n"
+	"MP_YAW = ABS_RX Fuzz=0 Flat=0\n"
+	"MP_PITCH = ABS_RY\n"
+	"\n"
+	"[Classic Controller]\n"
+	"KEY_A = BTN_A\n"
+	"KEY_B = BTN_B\n"
+	"KEY_X = BTN_X\n"
+	"KEY_Y = BTN_Y\n"
+	"KEY_TL = BTN_TL\n"
+	"KEY_TR = BTN_TR\n"
+	"KEY_ZL = BTN_TL2\n"
+	"KEY_ZR = BTN_TR2\n"
+	"KEY_THUMBL = BTN_THUMBL\n"
+	"KEY_THUMBR = BTN_THUMBR\n"
+	"CLASSIC_LX = ABS_X Deadzone=2\n"
+	"CLASSIC_LY = -ABS_Y Deadzone=2\n"
+	"CLASSIC_RX = ABS_RX Deadzone=1\n"
+	"CLASSIC_RY = -ABS_RY Deadzone=1\n"
+	"CLASSIC_LT = ABS_Z\n"
+	"CLASSIC_RT = ABS_RZ\n"
+	"\n";
+
+int bench_config(unsigned int copies) {
+	char *config = NULL;
+	size_t config_len = 0;
+	size_t *offsets;
+	struct keymaps *keymaps;
+	size_t bytes = 0, lines = 0;
+	int64_t ns = 0;
+	unsigned int i;
+	ssize_t ret;
+	FILE *stream;
+
+	offsets = malloc((copies + 1) * sizeof(*offsets));
+	if (!offsets)
+		return -ENOMEM;
+
+	stream = open_memstream(&config, &config_len);
+	if (!stream) {
+		ret = -errno;
+		free(offsets);
+		return ret;
+	}
+	for (i = 0; i < copies; ++i) {
+		offsets[i] = ftell(stream);
+		fprintf(stream, bench_template, i, i, 0x1000 + i % 0xf000, 0x2000 + i % 0xe000, 1 + i % 30);
+	}
+	offsets[copies] = ftell(stream);
+	if (fclose(stream)) {
+		ret = -errno;
+		free(config);
+		free(offsets);
+		return ret;
+	}
+
+	for (i = 0; i < copies; ++i) {
+		keymaps = NULL;
+		ret = parse_config_buffer(config + offsets[i], offsets[i + 1] - offsets[i], &keymaps);
+		if (ret) {
+			if (ret > 0)
+				fprintf(stderr, "Error in synthetic keymap %u on line %zd\n", i, ret);
+			free(config);
+			free(offsets);
+			return ret > 0 ? -EINVAL : ret;
+		}
+		free_keymaps(keymaps);
+		bytes += parse_stats.bytes;
+		lines += parse_stats.lines;
+		ns += parse_stats.ns;
+	}
+	free(config);
+	free(offsets);
+
+	if (!ns)
+		ns = 1;
+	printf("Parsed %u keymaps, %u sections, %zu lines, %.1f MB in %.3f ms\n",
+			copies, copies * BENCH_SECTIONS, lines, bytes / 1e6, ns / 1e6);
+	printf("%.1f MB/s, %.0f lines/s\n", bytes * 1e3 / ns, lines * 1e9 / ns);
+	return 0;
+}
@@ -0,0 +1,11 @@
+#ifndef __W2G_BENCH_H
+#define __W2G_BENCH_H
+
+/*
+ * Generate a config of the given number of keymaps, each with every section
+ * and most kinds of entries, parse each keymap in turn and print the parser's
+ * throughput. Returns 0 on success or a negative error code.
+ */
+int bench_config(unsigned int copies);
+
+#endif // __W2G_BENCH_H
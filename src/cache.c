@@ -0,0 +1,369 @@
+#include "cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/input.h>
+#include <xwiimote.h>
+
+#include "arena.h"
+#include "config.h"
+
+#define CACHE_MAGIC "W2GK"
+#define CACHE_VERSION 7
+#define NUM_KEYMAPS 3
+#define NO_NAME UINT32_MAX
+
+extern struct map_data keymap_core[XWII_KEY_NUM],
+	keymap_nunchuk[XWII_KEY_NUM],
+	keymap_classic[XWII_KEY_NUM];
+extern struct axis_map axismap_core[AXIS_NUM],
+	axismap_nunchuk[AXIS_NUM],
+	axismap_classic[AXIS_NUM];
+extern struct combo_map combomap_core[COMBOS_MAX],
+	combomap_nunchuk[COMBOS_MAX],
+	combomap_classic[COMBOS_MAX];
+extern struct controller_data controller_core,
+	controller_nunchuk,
+	controller_classic;
+extern struct macro_step macro_steps[MACRO_STEPS];
+extern unsigned int macro_steps_len;
+extern struct arena config_arena;
+
+static struct map_data *const keymaps[NUM_KEYMAPS] = {
+	keymap_core,
+	keymap_nunchuk,
+	keymap_classic,
+};
+static struct axis_map *const axismaps[NUM_KEYMAPS] = {
+	axismap_core,
+	axismap_nunchuk,
+	axismap_classic,
+};
+static struct combo_map *const combomaps[NUM_KEYMAPS] = {
+	combomap_core,
+	combomap_nunchuk,
+	combomap_classic,
+};
+static struct controller_data *const controllers[NUM_KEYMAPS] = {
+	&controller_core,
+	&controller_nunchuk,
+	&controller_classic,
+};
+
+/*
+ * File layout: the header, the keymaps, the axis maps, the combinations, the
+ * macro steps, the controllers and then the controller names.
+ */
+struct cache_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t key_num;
+	uint32_t map_size;
+	uint32_t names_len;
+	uint32_t axis_num;
+	uint32_t axis_map_size;
+	uint32_t combo_num;
+	uint32_t combo_map_size;
+	uint32_t macro_steps; // Steps used, of MACRO_STEPS
+	// The config file the cache was compiled from
+	int64_t source_mtime; // Nanoseconds
+	uint64_t source_size;
+	uint64_t source_hash;
+};
+
+struct cache_controller {
+	int32_t vendor;
+	int32_t product;
+	uint32_t name_offset;
+	uint32_t name_len; // NO_NAME if no name was given
+};
+
+#define KEYMAPS_SIZE (NUM_KEYMAPS * XWII_KEY_NUM * sizeof(struct map_data))
+#define AXISMAPS_SIZE (NUM_KEYMAPS * AXIS_NUM * sizeof(struct axis_map))
+#define MACROS_SIZE (MACRO_STEPS * sizeof(struct macro_step))
+#define COMBOMAPS_SIZE (NUM_KEYMAPS * COMBOS_MAX * sizeof(struct combo_map))
+#define COMBOMAPS_OFFSET (sizeof(struct cache_header) + KEYMAPS_SIZE + AXISMAPS_SIZE)
+#define MACROS_OFFSET (COMBOMAPS_OFFSET + COMBOMAPS_SIZE)
+#define CONTROLLERS_OFFSET (MACROS_OFFSET + MACROS_SIZE)
+#define NAMES_OFFSET (CONTROLLERS_OFFSET + NUM_KEYMAPS * sizeof(struct cache_controller))
+
+// FNV-1a
+static uint64_t hash(const char *data, size_t len) {
+	uint64_t h = 0xcbf29ce484222325;
+	size_t i;
+	for (i = 0; i < len; ++i) {
+		h ^= (unsigned char) data[i];
+		h *= 0x100000001b3;
+	}
+	return h;
+}
+
+static char *cache_path(const char *path) {
+	char *cpath = malloc(strlen(path) + sizeof(CACHE_SUFFIX));
+	if (cpath) {
+		strcpy(cpath, path);
+		strcat(cpath, CACHE_SUFFIX);
+	}
+	return cpath;
+}
+
+static void fill_header(struct cache_header *header, const char *src, size_t len, const struct stat *st) {
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+	header->version = CACHE_VERSION;
+	header->key_num = XWII_KEY_NUM;
+	header->map_size = sizeof(struct map_data);
+	header->axis_num = AXIS_NUM;
+	header->axis_map_size = sizeof(struct axis_map);
+	header->combo_num = COMBOS_MAX;
+	header->combo_map_size = sizeof(struct combo_map);
+	header->source_mtime = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+	header->source_size = len;
+	header->source_hash = hash(src, len);
+}
+
+/*
+ * Check that a cached mapping writes a code which exists for its type, as the
+ * parser does
+ */
+static int valid_output(const struct map_data *map) {
+	switch (map->intype) {
+	case IN_TYPE_KEY_OR_BTN:
+		return map->input <= KEY_MAX;
+	case IN_TYPE_REL:
+		return map->input <= REL_MAX;
+	case IN_TYPE_ABS:
+		return map->input < ABS_CNT;
+	default:
+		return true;
+	}
+}
+
+/*
+ * Check that a cache of the given size can be used in place of the config
+ * file
+ */
+static int validate(const char *data, size_t size, const struct cache_header *expected) {
+	const struct cache_header *header = (const void *) data;
+	const struct map_data *maps;
+	const struct axis_map *axes;
+	const struct combo_map *combos;
+	const struct cache_controller *ctrl;
+	const struct macro_step *steps;
+	int i, j;
+
+	if (size < NAMES_OFFSET)
+		return false;
+	// Compare everything but names_len and macro_steps
+	if (memcmp(header->magic, expected->magic, sizeof(header->magic))
+			|| header->version != expected->version
+			|| header->key_num != expected->key_num
+			|| header->map_size != expected->map_size
+			|| header->axis_num != expected->axis_num
+			|| header->axis_map_size != expected->axis_map_size
+			|| header->combo_num != expected->combo_num
+			|| header->combo_map_size != expected->combo_map_size
+			|| header->source_mtime != expected->source_mtime
+			|| header->source_size != expected->source_size
+			|| header->source_hash != expected->source_hash
+			|| size - NAMES_OFFSET != header->names_len
+			|| header->macro_steps > MACRO_STEPS)
+		return false;
+
+	maps = (const void *) (data + sizeof(*header));
+	for (i = 0; i < NUM_KEYMAPS * XWII_KEY_NUM; ++i) {
+		if (maps[i].intype > IN_TYPE_MACRO
+				|| !valid_output(maps + i)
+				|| (IN_TYPE_MACRO == maps[i].intype
+				&& maps[i].macro + maps[i].macro_len > header->macro_steps))
+			return false;
+	}
+
+	axes = (const void *) (data + sizeof(*header) + KEYMAPS_SIZE);
+	for (i = 0; i < NUM_KEYMAPS * AXIS_NUM; ++i) {
+		// The parser only allows positive options, and the deadzone is
+		// checked against the default range when compiled
+		if (axes[i].out.intype > IN_TYPE_ABS
+				|| !valid_output(&axes[i].out)
+				|| axes[i].curve_len < 0 || axes[i].curve_len > CURVE_POINTS
+				|| axes[i].smoothing < 0 || axes[i].max < 0
+				|| axes[i].range < 0 || axes[i].deadzone < 0
+				|| (axes[i].range && axes[i].deadzone >= axes[i].range))
+			return false;
+	}
+
+	combos = (const void *) (data + COMBOMAPS_OFFSET);
+	for (i = 0; i < NUM_KEYMAPS * COMBOS_MAX; ++i) {
+		if (combos[i].out.intype > IN_TYPE_ABS
+				|| !valid_output(&combos[i].out)
+				|| (combos[i].keys && !combos[i].out.intype)
+				|| combos[i].keys >= 1u << XWII_KEY_NUM)
+			return false;
+	}
+
+	steps = (const void *) (data + MACROS_OFFSET);
+	for (i = 0; i < (int) header->macro_steps; ++i) {
+		if (steps[i].len > MACRO_KEYS)
+			return false;
+		for (j = 0; j < steps[i].len; ++j) {
+			if (steps[i].codes[j] > KEY_MAX)
+				return false;
+		}
+	}
+
+	ctrl = (const void *) (data + CONTROLLERS_OFFSET);
+	for (i = 0; i < NUM_KEYMAPS; ++i) {
+		if (NO_NAME != ctrl[i].name_len
+				&& (ctrl[i].name_offset > header->names_len
+				|| ctrl[i].name_len > header->names_len - ctrl[i].name_offset))
+			return false;
+	}
+	return true;
+}
+
+int load_config_cache(const char *path, const char *src, size_t len, const struct stat *st) {
+	struct cache_header expected;
+	struct stat cache_st;
+	const struct cache_controller *ctrl;
+	const char *data, *names;
+	char *cpath;
+	int fd;
+	int i;
+
+	cpath = cache_path(path);
+	if (!cpath)
+		return -ENOMEM;
+	fd = open(cpath, O_RDONLY);
+	free(cpath);
+	if (-1 == fd)
+		return ENOENT == errno ? 1 : -errno;
+	if (-1 == fstat(fd, &cache_st) || cache_st.st_size < NAMES_OFFSET) {
+		close(fd);
+		return 1;
+	}
+
+	data = mmap(NULL, cache_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == data)
+		return -errno;
+
+	fill_header(&expected, src, len, st);
+	if (!validate(data, cache_st.st_size, &expected)) {
+		munmap((void *) data, cache_st.st_size);
+		return 1;
+	}
+
+	for (i = 0; i < NUM_KEYMAPS; ++i) {
+		memcpy(keymaps[i], data + sizeof(expected) + i * XWII_KEY_NUM * sizeof(struct map_data),
+				XWII_KEY_NUM * sizeof(struct map_data));
+	}
+
+	for (i = 0; i < NUM_KEYMAPS; ++i) {
+		memcpy(axismaps[i], data + sizeof(expected) + KEYMAPS_SIZE + i * AXIS_NUM * sizeof(struct axis_map),
+				AXIS_NUM * sizeof(struct axis_map));
+	}
+
+	for (i = 0; i < NUM_KEYMAPS; ++i) {
+		memcpy(combomaps[i], data + COMBOMAPS_OFFSET + i * COMBOS_MAX * sizeof(struct combo_map),
+				COMBOS_MAX * sizeof(struct combo_map));
+	}
+
+	memcpy(macro_steps, data + MACROS_OFFSET, MACROS_SIZE);
+	macro_steps_len = ((const struct cache_header *) data)->macro_steps;
+
+	ctrl = (const void *) (data + CONTROLLERS_OFFSET);
+	names = data + NAMES_OFFSET;
+	for (i = 0; i < NUM_KEYMAPS; ++i) {
+		controllers[i]->vendor = ctrl[i].vendor;
+		controllers[i]->product = ctrl[i].product;
+		if (NO_NAME != ctrl[i].name_len) {
+			controllers[i]->name = arena_strndup(&config_arena, names + ctrl[i].name_offset,
+					ctrl[i].name_len);
+		}
+	}
+
+	munmap((void *) data, cache_st.st_size);
+	return 0;
+}
+
+int write_config_cache(const char *path, const char *src, size_t len, const struct stat *st) {
+	struct cache_header header;
+	struct cache_controller ctrl[NUM_KEYMAPS];
+	char *cpath, *tmppath;
+	FILE *file;
+	int ret = 0;
+	int i;
+
+	fill_header(&header, src, len, st);
+	header.macro_steps = macro_steps_len;
+	for (i = 0; i < NUM_KEYMAPS; ++i) {
+		ctrl[i].vendor = controllers[i]->vendor;
+		ctrl[i].product = controllers[i]->product;
+		ctrl[i].name_offset = header.names_len;
+		if (controllers[i]->name) {
+			ctrl[i].name_len = strlen(controllers[i]->name);
+			header.names_len += ctrl[i].name_len;
+		} else {
+			ctrl[i].name_len = NO_NAME;
+		}
+	}
+
+	cpath = cache_path(path);
+	tmppath = cpath ? malloc(strlen(cpath) + sizeof(".tmp")) : NULL;
+	if (!tmppath) {
+		free(cpath);
+		return -ENOMEM;
+	}
+	strcpy(tmppath, cpath);
+	strcat(tmppath, ".tmp");
+
+	// Write to a temporary file so the cache is replaced atomically
+	file = fopen(tmppath, "wb");
+	if (!file) {
+		ret = -errno;
+		goto out;
+	}
+	if (1 != fwrite(&header, sizeof(header), 1, file))
+		ret = -EIO;
+	for (i = 0; i < NUM_KEYMAPS && !ret; ++i) {
+		if (1 != fwrite(keymaps[i], XWII_KEY_NUM * sizeof(struct map_data), 1, file))
+			ret = -EIO;
+	}
+	for (i = 0; i < NUM_KEYMAPS && !ret; ++i) {
+		if (1 != fwrite(axismaps[i], AXIS_NUM * sizeof(struct axis_map), 1, file))
+			ret = -EIO;
+	}
+	for (i = 0; i < NUM_KEYMAPS && !ret; ++i) {
+		if (1 != fwrite(combomaps[i], COMBOS_MAX * sizeof(struct combo_map), 1, file))
+			ret = -EIO;
+	}
+	if (!ret && 1 != fwrite(macro_steps, MACROS_SIZE, 1, file))
+		ret = -EIO;
+	if (!ret && 1 != fwrite(ctrl, sizeof(ctrl), 1, file))
+		ret = -EIO;
+	for (i = 0; i < NUM_KEYMAPS && !ret; ++i) {
+		if (NO_NAME != ctrl[i].name_len && ctrl[i].name_len
+				&& 1 != fwrite(controllers[i]->name, ctrl[i].name_len, 1, file))
+			ret = -EIO;
+	}
+	if (fclose(file) && !ret)
+		ret = -errno;
+
+	if (!ret && -1 == rename(tmppath, cpath))
+		ret = -errno;
+	if (ret)
+		unlink(tmppath);
+
+out:
+	free(tmppath);
+	free(cpath);
+	return ret;
+}
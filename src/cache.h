@@ -0,0 +1,27 @@
+#ifndef __W2G_CACHE_H
+#define __W2G_CACHE_H
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define CACHE_SUFFIX ".cache"
+
+/*
+ * The cache holds the parsed keymaps of a config file, after defaults have
+ * been applied. It is stored next to the config file and is only valid for
+ * the config file it was compiled from.
+ */
+
+/*
+ * Load the keymaps cached for the config file at path. src and st are the
+ * contents and status of the config file. Returns 0 on success, 1 if there
+ * is no valid cache or a negative error code.
+ */
+int load_config_cache(const char *path, const char *src, size_t len, const struct stat *st);
+
+/*
+ * Write the current keymaps to the cache for the config file at path
+ */
+int write_config_cache(const char *path, const char *src, size_t len, const struct stat *st);
+
+#endif // __W2G_CACHE_H
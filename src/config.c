@@ -1,49 +1,100 @@
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 
-#include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <math.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <linux/input.h>
 #include <xwiimote.h>
 
+#include "arena.h"
+#include "axis.h"
+#include "cache.h"
 #include "config.h"
 #include "keymap.h"
 #include "util.h"
 
-extern struct map_data keymap_core[XWII_KEY_NUM],
+// The config being read, also filled by the cache. Compiled into a struct
+// keymaps once defaults are applied, and cleared before the next read.
+struct map_data keymap_core[XWII_KEY_NUM],
 	keymap_nunchuk[XWII_KEY_NUM],
-	keymap_classic[XWII_KEY_NUM];
-struct map_data keymap_all[XWII_KEY_NUM];
-extern struct controller_data controller_core,
+	keymap_classic[XWII_KEY_NUM],
+	keymap_all[XWII_KEY_NUM];
+struct axis_map axismap_core[AXIS_NUM],
+	axismap_nunchuk[AXIS_NUM],
+	axismap_classic[AXIS_NUM],
+	axismap_all[AXIS_NUM];
+struct combo_map combomap_core[COMBOS_MAX],
+	combomap_nunchuk[COMBOS_MAX],
+	combomap_classic[COMBOS_MAX],
+	combomap_all[COMBOS_MAX];
+struct controller_data controller_core,
 	controller_nunchuk,
-	controller_classic;
-struct controller_data controller_all;
+	controller_classic,
+	controller_all;
+struct macro_step macro_steps[MACRO_STEPS];
+unsigned int macro_steps_len;
+struct arena config_arena; // Strings kept from the config, such as names
+
+struct parse_stats parse_stats;
 
 static int ext;
 
 static inline int is_whitespace(char c) {
-	return ' ' == c || '\t' == c;
+	return ' ' == c || '\t' == c || '\r' == c;
 }
 static inline int is_alphanum(char c) {
 	return ('A' <= c && 'Z' >= c) || ('0' <= c && '9' >= c) || '_' == c;
 }
 
-enum read_state {
-	RS_INIT,
-	RS_NORMAL,
-	RS_COMMENT,
-};
+// Line being parsed, for error messages
+static struct {
+	const char *start;
+	size_t line;
+} pos;
+
+static void report_error(size_t line, size_t column, const char *fmt, va_list args) {
+	fprintf(stderr, "Line %zu, column %zu: ", line, column);
+	vfprintf(stderr, fmt, args);
+	fputc('\n', stderr);
+}
+
+/*
+ * Report an error at a character of the line being parsed
+ */
+static void parse_error(const char *at, const char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	report_error(pos.line, (size_t) (at - pos.start) + 1, fmt, args);
+	va_end(args);
+}
 
-static void fnputs(FILE *stream, const char *s, size_t len) {
-	for (int i = 0; i < len; ++i)
-		fputc(s[i], stream);
+/*
+ * Note that a mapping starts at a character of the line being parsed
+ */
+static void mark_map(struct map_data *map, const char *at) {
+	map->line = pos.line;
+	map->column = (at - pos.start) + 1;
 }
 
+/*
+ * Report an error in a mapping, once its line is no longer being parsed
+ */
+static void map_error(const struct map_data *map, const char *fmt, ...) {
+	va_list args;
+
+	va_start(args, fmt);
+	report_error(map->line, map->column, fmt, args);
+	va_end(args);
+}
 
 static int interpret_label(const char *label, size_t label_len) {
 	if (strmatch("None", label, label_len)) {
@@ -55,16 +106,17 @@ static int interpret_label(const char *label, size_t label_len) {
 	} else if (strmatch("All", label, label_len)) {
 		ext = -1;
 	} else {
-		fprintf(stderr, "Extension ");
-		fnputs(stderr, label, label_len);
-		fprintf(stderr, " not recognized\n");
+		parse_error(label, "Extension %.*s not recognized", (int) label_len, label);
 		return -1;
 	}
 	return 0;
 }
 
+static int parse_fixed(const char *c, size_t len, int decimals, int32_t *out);
+
 static int read_controller_info(const char *left_token, size_t left_token_len, const char *right_token, size_t right_token_len) {
 	struct controller_data *cdata;
+	int32_t id;
 
 	if (XWII_IFACE_CORE == ext) {
 		cdata = &controller_core;
@@ -81,25 +133,32 @@ static int read_controller_info(const char *left_token, size_t left_token_len, c
 	
 	if (strmatch("Name", left_token, left_token_len)) {
 		if (cdata->name) {
-			fprintf(stderr, "Name already specified\n");
+			parse_error(left_token, "Name already specified");
 			return -1;
 		}
-		// Copy name to cdata
-		cdata->name = malloc(right_token_len + 1); // Not bothering to free()
-		memcpy(cdata->name, right_token, right_token_len);
-		cdata->name[right_token_len] = '\0';
+		cdata->name = arena_strndup(&config_arena, right_token, right_token_len);
+		if (!cdata->name)
+			return -1;
 	} else if (strmatch("Vendor", left_token, left_token_len)) {
 		if (cdata->vendor) {
-			fprintf(stderr, "Vendor already specified\n");
+			parse_error(left_token, "Vendor already specified");
+			return -1;
+		}
+		if (parse_fixed(right_token, right_token_len, 0, &id) || id < 1 || id > UINT16_MAX) {
+			parse_error(right_token, "Vendor needs an ID from 1 to 0xffff");
 			return -1;
 		}
-		cdata->vendor = atoi(right_token);
+		cdata->vendor = id;
 	} else if (strmatch("Product", left_token, left_token_len)) {
 		if (cdata->product) {
-			fprintf(stderr, "Product ID already specified\n");
+			parse_error(left_token, "Product ID already specified");
 			return -1;
 		}
-		cdata->product = atoi(right_token);
+		if (parse_fixed(right_token, right_token_len, 0, &id) || id < 1 || id > UINT16_MAX) {
+			parse_error(right_token, "Product needs an ID from 1 to 0xffff");
+			return -1;
+		}
+		cdata->product = id;
 	} else {
 		return 1;
 	}
@@ -120,36 +179,44 @@ enum xwii_event_keys get_wii_key(const char *c, size_t len) {
 	return -1;
 }
 
+/*
+ * Binary search input_codes for the given token
+ */
+static const struct input_code *find_input_code(const char *c, size_t len) {
+	size_t lo = 0, hi = sizeof(input_codes) / sizeof(input_codes[0]);
+	const struct input_code *code;
+	int cmp;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		code = input_codes + mid;
+
+		cmp = memcmp(code->name, c, code->len < len ? code->len : len);
+		if (!cmp)
+			cmp = (int) code->len - (int) len;
+
+		if (!cmp)
+			return code;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
 /*
  * Identify whether the token corresponds to a key/button, relative axis, or
  * absolute axis. Save this data to out.
  */
 static int get_map_key(const char *c, size_t len, struct map_data *out) {
-	int i;
-	for (i = 0; map_key_map[i].key; ++i) {
-		if (strmatch(map_key_map[i].key, c, len)) {
-			out->intype = IN_TYPE_KEY_OR_BTN;
-			out->input = map_key_map[i].value;
-			return 0;
-		}
-	}
-	for (i = 0; map_rel_map[i].key; ++i) {
-		if (strmatch(map_rel_map[i].key, c, len)) {
-			out->intype = IN_TYPE_REL;
-			out->input = map_rel_map[i].value;
-			return 0;
-		}
-	}
-	for (i = 0; map_abs_map[i].key; ++i) {
-		if (strmatch(map_abs_map[i].key, c, len)) {
-			out->intype = IN_TYPE_ABS;
-			out->input = map_abs_map[i].value;
-			return 0;
-		}
+	const struct input_code *code = find_input_code(c, len);
+	if (code) {
+		out->intype = code->intype;
+		out->input = code->value;
+		return 0;
 	}
-	fprintf(stderr, "Key ");
-	fnputs(stderr, c, len);
-	fprintf(stderr, " not understood\n", c);
+	parse_error(c, "Key %.*s not understood", (int) len, c);
 	return -1;
 }
 
@@ -170,7 +237,7 @@ static int store_key(enum xwii_iface_type ext, enum xwii_event_keys wii_key, str
 
 	// Check for previous entry
 	if (map[(long) wii_key].intype) {
-		fprintf(stderr, "Duplicate entry\n");
+		map_error(mdata, "Duplicate entry");
 		return -1;
 	}
 
@@ -178,176 +245,568 @@ static int store_key(enum xwii_iface_type ext, enum xwii_event_keys wii_key, str
 	return 0;
 }
 
-static int read_mapped_key(const char *left_token, size_t left_token_len,
+/*
+ * Add a combination to a keymap's list
+ */
+static int store_combo(struct combo_map *map, const struct combo_map *combo) {
+	int i;
+
+	for (i = 0; i < COMBOS_MAX && map[i].keys; ++i) {
+		if (map[i].keys == combo->keys) {
+			map_error(&combo->out, "Duplicate entry");
+			return -1;
+		}
+	}
+	if (COMBOS_MAX == i) {
+		map_error(&combo->out, "More than %d combinations", COMBOS_MAX);
+		return -1;
+	}
+	map[i] = *combo;
+	return 0;
+}
+
+/*
+ * Read a combination of Wii keys joined by +, such as KEY_HOME+KEY_A
+ */
+static int read_mapped_combo(const char *left_token, size_t left_token_len,
 		const char *right_token, size_t right_token_len) {
-	int wii_key;
-	struct map_data mdata;
-	int err;
+	const char *left_end = left_token + left_token_len, *end = right_token + right_token_len;
+	const char *key, *c;
+	struct combo_map combo = { 0 }, *map;
+	int wii_key, keys = 0;
 
-	wii_key = get_wii_key(left_token, left_token_len);
-	if (wii_key == -1) {
-		return wii_key;
+	mark_map(&combo.out, left_token);
+	for (c = left_token; c <= left_end; ++c) {
+		for (key = c; c < left_end && '+' != *c; ++c);
+		wii_key = get_wii_key(key, c - key);
+		if (-1 == wii_key) {
+			parse_error(key, "Wii key %.*s not understood", (int) (c - key), key);
+			return -1;
+		}
+		if (combo.keys & 1u << wii_key) {
+			parse_error(key, "Key repeated in combination");
+			return -1;
+		}
+		combo.keys |= 1u << wii_key;
+		++keys;
+	}
+	if (keys > COMBO_KEYS + 1) {
+		parse_error(left_token, "More than %d keys in a combination", COMBO_KEYS + 1);
+		return -1;
 	}
 
 	// Read - sign -- reverse input
 	if ('-' == right_token[0]) {
-		mdata.reversed = true;
+		combo.out.reversed = true;
 		++right_token;
-		--right_token_len;
+	}
+	for (c = right_token; c < end && !is_whitespace(*c); ++c);
+	if (get_map_key(right_token, c - right_token, &combo.out))
+		return -1;
+	if (c != end) {
+		parse_error(c, "Combinations take no options");
+		return -1;
+	}
+
+	if (XWII_IFACE_CORE == ext) {
+		map = combomap_core;
+	} else if (XWII_IFACE_NUNCHUK == ext) {
+		map = combomap_nunchuk;
+	} else if (XWII_IFACE_CLASSIC_CONTROLLER == ext) {
+		map = combomap_classic;
+	} else if (-1 == ext) {
+		map = combomap_all;
 	} else {
-		mdata.reversed = false;
+		fprintf(stderr, "Internal error, ext not recognized\n");
+		return -1;
 	}
-	if (err = get_map_key(right_token, right_token_len, &mdata)) {
-		return err;
+	return store_combo(map, &combo);
+}
+
+/*
+ * Convert the given analog source into an axis_source
+ */
+static int get_axis_source(const char *c, size_t len) {
+	int i;
+	for (i = 0; i < AXIS_NUM; ++i) {
+		if (strmatch(axis_source_map[i].name, c, len)) {
+			return axis_source_map[i].value;
+		}
 	}
-	// Store key
-	if (err = store_key(ext, wii_key, &mdata)) {
-		return err;
+	return -1;
+}
+
+/*
+ * Parse a decimal number taking up all of c, with up to `decimals` digits
+ * after the point. The result is scaled by 10^decimals. Integers may also be
+ * given in hexadecimal, after 0x.
+ */
+static int parse_fixed(const char *c, size_t len, int decimals, int32_t *out) {
+	int64_t value = 0;
+	int negative = false;
+	int digits = 0;
+	int point = -1; // Digits after the point
+	size_t i = 0;
+	int hex;
+
+	if (len && '-' == c[0]) {
+		negative = true;
+		++i;
+	}
+	if (!decimals && len - i > 2 && '0' == c[i] && ('x' == c[i + 1] || 'X' == c[i + 1])) {
+		for (i += 2; i < len && value <= INT32_MAX; ++i) {
+			if ('0' <= c[i] && '9' >= c[i])
+				hex = c[i] - '0';
+			else if ('a' <= (c[i] | 0x20) && 'f' >= (c[i] | 0x20))
+				hex = (c[i] | 0x20) - 'a' + 10;
+			else
+				return -1;
+			value = value << 4 | hex;
+		}
+		if (value > INT32_MAX)
+			return -1;
+		*out = negative ? -value : value;
+		return 0;
+	}
+	for (; i < len; ++i) {
+		if ('.' == c[i] && -1 == point) {
+			point = 0;
+			continue;
+		}
+		if ('0' > c[i] || '9' < c[i] || value > INT32_MAX || point == decimals)
+			return -1;
+		value = value * 10 + c[i] - '0';
+		++digits;
+		if (-1 != point)
+			++point;
 	}
+	if (!digits)
+		return -1;
+	for (point = point < 0 ? 0 : point; point < decimals; ++point)
+		value *= 10;
+	if (value > INT32_MAX)
+		return -1;
+	*out = negative ? -value : value;
 	return 0;
 }
 
-static int interpret_line(const char *left_token, size_t left_token_len,
-		const char *right_token, size_t right_token_len) {
-	int err;
-	if (!(err = read_controller_info(left_token, left_token_len, right_token, right_token_len))) {
+/*
+ * Split the next Option=value setting off the text from *c to end. Returns 1
+ * if a setting was read, 0 at the end of the text or -1 on a syntax error.
+ */
+static int next_option(const char **c, const char *end, const char **name, size_t *name_len,
+		const char **value) {
+	const char *p = *c;
+
+	while (p < end && is_whitespace(*p))
+		++p;
+	if (p == end)
 		return 0;
+
+	*name = p;
+	while (p < end && '=' != *p && !is_whitespace(*p))
+		++p;
+	*name_len = p - *name;
+	if (p == end || '=' != *p) {
+		parse_error(p, "= expected after option");
+		return -1;
 	}
-	if (1 == err && 0 == read_mapped_key(left_token, left_token_len, right_token, right_token_len)) {
-		return 0;
+	*value = ++p;
+	while (p < end && !is_whitespace(*p))
+		++p;
+	*c = p;
+	return 1;
+}
+
+/*
+ * Read the Option=value settings following the key of a key mapping
+ */
+static int read_key_options(const char *c, size_t len, struct map_data *mdata) {
+	const char *end = c + len, *name, *value;
+	size_t name_len;
+	int32_t turbo;
+	int ret;
+
+	while (0 < (ret = next_option(&c, end, &name, &name_len, &value))) {
+		if (!strmatch("Turbo", name, name_len)) {
+			parse_error(name, "Option %.*s not recognized", (int) name_len, name);
+			return -1;
+		}
+		if (IN_TYPE_KEY_OR_BTN != mdata->intype) {
+			parse_error(name, "Turbo needs a key or button");
+			return -1;
+		}
+		if (parse_fixed(value, c - value, 0, &turbo) || turbo < 1 || turbo > TURBO_MAX) {
+			parse_error(value, "Turbo needs a rate from 1 to %d Hz", TURBO_MAX);
+			return -1;
+		}
+		mdata->turbo = turbo;
 	}
-	return -1;	
+	return ret;
 }
 
 /*
- * Returns 0 on success or a positive line number on error.
+ * Read a macro: steps of keys joined by +, each followed by /duration in ms.
+ * A step with no keys is a pause.
  */
-static ssize_t parse_config(char *file, size_t filelen) {
-	const char *c = file, *c2;
-	size_t line = 1;
-	const char *left_token, *right_token, *label;
-	size_t left_token_len, right_token_len, label_len;
-	enum read_state state = RS_INIT;
-	const char *equals, *line_end;
-	int err;
+static int read_macro(const char *c, size_t len, struct map_data *mdata) {
+	const char *end = c + len, *key, *value;
+	struct map_data out;
+	struct macro_step *step;
+	int32_t ms;
 
-	
-	while (c < file + filelen) {
-		// Skip whitespace
-		while (c < file + filelen && (is_whitespace(*c) || '\n' == *c)) {
-			if ('\n' == *c)
-				++line;
+	mdata->intype = IN_TYPE_MACRO;
+	mdata->macro = macro_steps_len;
+	while (c < end) {
+		while (c < end && is_whitespace(*c))
 			++c;
+		if (c == end)
+			break;
+
+		if (MACRO_STEPS == macro_steps_len) {
+			parse_error(c, "More than %d macro steps", MACRO_STEPS);
+			return -1;
 		}
-		if (c == file + filelen)
-			return 0;
+		step = macro_steps + macro_steps_len++;
+		memset(step, 0, sizeof(*step));
 
-		if (*c == ';') {
-		 state = RS_COMMENT;
+		while (c < end && '/' != *c) {
+			for (key = c; c < end && '+' != *c && '/' != *c && !is_whitespace(*c); ++c);
+			if (MACRO_KEYS == step->len) {
+				parse_error(key, "More than %d keys in a macro step", MACRO_KEYS);
+				return -1;
+			}
+			if (get_map_key(key, c - key, &out))
+				return -1;
+			if (IN_TYPE_KEY_OR_BTN != out.intype) {
+				parse_error(key, "Macros can only press keys and buttons");
+				return -1;
+			}
+			step->codes[step->len++] = out.input;
+			// Another key must follow a +
+			if (c == end || '+' != *c)
+				break;
+			++c;
+			if (c == end || '/' == *c || is_whitespace(*c)) {
+				parse_error(c, "Key expected after +");
+				return -1;
+			}
+		}
+		if (c == end || '/' != *c) {
+			parse_error(c, "/ expected after macro keys");
+			return -1;
 		}
 
-		switch (state) {
-		case RS_INIT:
-			// Read a section label
-			if ('[' != *c)
-				return line;
+		value = ++c;
+		while (c < end && !is_whitespace(*c))
+			++c;
+		if (parse_fixed(value, c - value, 0, &ms) || ms < 1 || ms > UINT16_MAX) {
+			parse_error(value, "Macro step needs a duration in ms");
+			return -1;
+		}
+		step->ms = ms;
+	}
+	mdata->macro_len = macro_steps_len - mdata->macro;
+	return 0;
+}
 
-			state = RS_NORMAL;
-			// No break
-		case RS_NORMAL:
-			// Read label
-			if ('[' == *c) {
-				++c;
-				label = c;
-				while (']' != *c) {
-					if (*c == '\n' || ';' == *c) {
-						fprintf(stderr, "] expected\n");
-						return line;
-					}
-					++c;
-				}
-				assert (']' == *c);
-				label_len = c - label;
+/*
+ * Read a response curve: input:output points joined by commas, in percent of
+ * the range and of the axis
+ */
+static int read_curve(const char *c, size_t len, struct axis_map *amap) {
+	const char *end = c + len, *value, *start;
+	int32_t point[2];
+	int i;
 
-				if (interpret_label(label, label_len)) {
-					return line;
-				}
+	amap->curve_len = 0;
+	while (c < end) {
+		if (CURVE_POINTS == amap->curve_len) {
+			parse_error(c, "More than %d curve points", CURVE_POINTS);
+			return -1;
+		}
+		start = c;
+		for (i = 0; i < 2; ++i) {
+			for (value = c; c < end && ':' != *c && ',' != *c; ++c);
+			if (parse_fixed(value, c - value, 0, point + i) || point[i] < 0 || point[i] > 100
+					|| (!i && (c == end || ':' != *c)) || (i && c < end && ',' != *c)) {
+				parse_error(value, "Curve points are input:output, in percent");
+				return -1;
+			}
+			if (c < end)
 				++c;
-			} else {
-				// Read regular line
-				left_token = c;
-
-				// Find equals sign
-				while ('=' != *c) {
-					if ('\n' == *c) {
-						fprintf(stderr, "= expected\n");
-						return line;
-					}
-					++c;
-				}
-				equals = c;
+		}
+		if (point[0] <= (amap->curve_len ? amap->curve[amap->curve_len - 1][0] : 0)
+				|| 100 == point[0]) {
+			parse_error(start, "Curve inputs must increase between 0 and 100");
+			return -1;
+		}
+		amap->curve[amap->curve_len][0] = point[0];
+		amap->curve[amap->curve_len][1] = point[1];
+		++amap->curve_len;
+	}
+	return 0;
+}
 
-				// Find the end of the string
-				for  (c = equals - 1; is_whitespace(*c); --c);
-				++c;
-				left_token_len = c - left_token;
-
-				// Skip whitespace
-				for (c = equals + 1; is_whitespace(*c); ++c) {
-					if ('\n' == *c || ';' == *c) {
-						fprintf(stderr, "Right token expected\n");
-						return line;
-					}
-				}
-				
-				// Find next token
-				right_token = c;
-				// Find the end of the line
-				while ('\n' != *c && ';' != *c) {
-					++c;
-				}
-				line_end = c;
-				// Denote the end of the string
-				--c;
-				while (is_whitespace(*c)) {
-					--c;
-				}
-				++c;
-				right_token_len = c - right_token;
-				// Skip to the end of the line
-				c = line_end;
-				
-				// Interpret and store the key
-				if (interpret_line(left_token, left_token_len, right_token,
-						right_token_len)) {
-					printf("Failed to interpret line\n");
-					return line;
-				}
+/*
+ * Read the Option=value settings following the axis of an analog mapping
+ */
+static int read_axis_options(const char *c, size_t len, struct axis_map *amap) {
+	const char *end = c + len, *name, *value;
+	size_t name_len;
+	int32_t *option;
+	int decimals;
+	int ret;
+
+	while (0 < (ret = next_option(&c, end, &name, &name_len, &value))) {
+		if (strmatch("Curve", name, name_len)) {
+			if (amap->expo) {
+				parse_error(name, "Expo and Curve can't be combined");
+				return -1;
 			}
+			if (read_curve(value, c - value, amap))
+				return -1;
+			continue;
+		}
 
-			break;
+		decimals = 0;
+		if (strmatch("Range", name, name_len)) {
+			option = &amap->range;
+		} else if (strmatch("Deadzone", name, name_len)) {
+			option = &amap->deadzone;
+		} else if (strmatch("Smoothing", name, name_len)) {
+			option = &amap->smoothing;
+		} else if (strmatch("Max", name, name_len)) {
+			option = &amap->max;
+		} else if (strmatch("Center", name, name_len)) {
+			option = &amap->center;
+		} else if (strmatch("Cutoff", name, name_len)) {
+			option = &amap->cutoff;
+			decimals = 6;
+		} else if (strmatch("Beta", name, name_len)) {
+			option = &amap->beta;
+			decimals = 6;
+		} else if (strmatch("Predict", name, name_len)) {
+			option = &amap->predict;
+		} else if (strmatch("Fuzz", name, name_len)) {
+			option = &amap->fuzz;
+		} else if (strmatch("Flat", name, name_len)) {
+			option = &amap->flat;
+		} else if (strmatch("Expo", name, name_len)) {
+			option = &amap->expo;
+			decimals = 3;
+		} else {
+			parse_error(name, "Option %.*s not recognized", (int) name_len, name);
+			return -1;
+		}
+		if (parse_fixed(value, c - value, decimals, option)
+				|| (*option < 0 && option != &amap->center)) {
+			parse_error(value, "Option %.*s needs a positive %s", (int) name_len, name,
+					decimals ? "number" : "integer");
+			return -1;
+		}
+		if (option == &amap->expo && amap->expo > 1000) {
+			parse_error(value, "Expo must be from 0 to 1");
+			return -1;
+		}
+		if (option == &amap->expo && amap->expo && amap->curve_len) {
+			parse_error(name, "Expo and Curve can't be combined");
+			return -1;
+		}
+		// 0 is kept for the default
+		if (option == &amap->fuzz || option == &amap->flat)
+			++*option;
+	}
+	return ret;
+}
 
-		case RS_COMMENT:
-			assert(*c == ';');
-			while ('\n' != *c)
-				++c;
-			if (ext) {
-				state = RS_NORMAL;
-			} else {
-				state = RS_INIT;
-			}
-			break;
-		} // switch
+static int read_mapped_key(const char *left_token, size_t left_token_len,
+		const char *right_token, size_t right_token_len) {
+	const char *end = right_token + right_token_len, *c;
+	int wii_key;
+	struct map_data mdata = { 0 };
+	int err;
+
+	wii_key = get_wii_key(left_token, left_token_len);
+	if (wii_key == -1) {
+		return wii_key;
+	}
+	mark_map(&mdata, left_token);
+
+	for (c = right_token; c < end && !is_whitespace(*c); ++c);
+	if (memchr(right_token, '/', c - right_token)) {
+		if ((err = read_macro(right_token, right_token_len, &mdata))) {
+			return err;
+		}
+	} else {
+		// Read - sign -- reverse input
+		if ('-' == right_token[0]) {
+			mdata.reversed = true;
+			++right_token;
+		}
+		if ((err = get_map_key(right_token, c - right_token, &mdata))) {
+			return err;
+		}
+		if ((err = read_key_options(c, end - c, &mdata))) {
+			return err;
+		}
+	}
+	// Store key
+	if ((err = store_key(ext, wii_key, &mdata))) {
+		return err;
+	}
+	return 0;
+}
+
+static int read_mapped_axis(const char *left_token, size_t left_token_len,
+		const char *right_token, size_t right_token_len) {
+	const char *end = right_token + right_token_len, *c;
+	struct axis_map amap = { 0 }, *map;
+	int source;
+
+	source = get_axis_source(left_token, left_token_len);
+	if (-1 == source)
+		return -1;
+
+	if (XWII_IFACE_CORE == ext) {
+		map = axismap_core;
+	} else if (XWII_IFACE_NUNCHUK == ext) {
+		map = axismap_nunchuk;
+	} else if (XWII_IFACE_CLASSIC_CONTROLLER == ext) {
+		map = axismap_classic;
+	} else if (-1 == ext) {
+		map = axismap_all;
+	} else {
+		fprintf(stderr, "Internal error, ext not recognized\n");
+		return -1;
+	}
+	if (map[source].out.intype) {
+		parse_error(left_token, "Duplicate entry");
+		return -1;
+	}
+	mark_map(&amap.out, left_token);
+
+	// Read - sign -- reverse axis
+	if ('-' == right_token[0]) {
+		amap.out.reversed = true;
+		++right_token;
+	}
+	for (c = right_token; c < end && !is_whitespace(*c); ++c);
+	if (get_map_key(right_token, c - right_token, &amap.out))
+		return -1;
+	if (read_axis_options(c, end - c, &amap))
+		return -1;
+
+	map[source] = amap;
+	return 0;
+}
+
+static int interpret_line(const char *left_token, size_t left_token_len,
+		const char *right_token, size_t right_token_len) {
+	int err;
+	if (memchr(left_token, '+', left_token_len)) {
+		return read_mapped_combo(left_token, left_token_len, right_token, right_token_len);
+	}
+	if (!(err = read_controller_info(left_token, left_token_len, right_token, right_token_len))) {
+		return 0;
+	}
+	if (1 != err) {
+		return -1;
+	}
+	if (-1 != get_wii_key(left_token, left_token_len)) {
+		return read_mapped_key(left_token, left_token_len, right_token, right_token_len);
+	}
+	if (-1 != get_axis_source(left_token, left_token_len)) {
+		return read_mapped_axis(left_token, left_token_len, right_token, right_token_len);
+	}
+	parse_error(left_token, "%.*s is not a Wii key, analog source or setting",
+			(int) left_token_len, left_token);
+	return -1;
+}
 
-		// No other tokens allowed
-		if ('\0' != *c && '\n' != *c && ';' != *c) {
-			fprintf(stderr, "Extra token\n");
-			return line;
+/*
+ * Trim the whitespace around the text from *start to *end
+ */
+static void trim(const char **start, const char **end) {
+	while (*start < *end && is_whitespace(**start))
+		++*start;
+	while (*end > *start && is_whitespace((*end)[-1]))
+		--*end;
+}
+
+/*
+ * Read one line, from start to end, excluding its newline and comment
+ */
+static int parse_line(const char *start, const char *end) {
+	const char *label_end, *equals, *left_end, *right_token;
+
+	trim(&start, &end);
+	if (start == end)
+		return 0;
+
+	// Section label
+	if ('[' == *start) {
+		label_end = memchr(start, ']', end - start);
+		if (!label_end) {
+			parse_error(end, "] expected");
+			return -1;
 		}
-	} // while
+		if (label_end + 1 != end) {
+			parse_error(label_end + 1, "Extra token");
+			return -1;
+		}
+		return interpret_label(start + 1, label_end - start - 1);
+	}
+	if (!ext) {
+		parse_error(start, "Section label expected");
+		return -1;
+	}
 
+	// Key = value
+	equals = memchr(start, '=', end - start);
+	if (!equals) {
+		parse_error(end, "= expected");
+		return -1;
+	}
+	left_end = equals;
+	trim(&start, &left_end);
+	if (start == left_end) {
+		parse_error(start, "Left token expected");
+		return -1;
+	}
+	right_token = equals + 1;
+	trim(&right_token, &end);
+	if (right_token == end) {
+		parse_error(end, "Right token expected");
+		return -1;
+	}
+	return interpret_line(start, left_end - start, right_token, end - right_token);
+}
+
+/*
+ * Tokenize the config in a single pass. Tokens point into the config, and
+ * nothing is read beyond its end, which needn't be a newline. Returns 0 on
+ * success or a positive line number on error.
+ */
+static ssize_t parse_config(const char *file, size_t filelen) {
+	const char *c = file, *end = file + filelen, *line_end, *comment;
 
+	ext = 0;
+	pos.line = 0;
+	while (c < end) {
+		++pos.line;
+		pos.start = c;
+		line_end = memchr(c, '\n', end - c);
+		if (!line_end)
+			line_end = end;
+		comment = memchr(c, ';', line_end - c);
 
+		if (parse_line(c, comment ? comment : line_end))
+			return pos.line;
+		c = line_end < end ? line_end + 1 : end;
+	}
+	parse_stats.bytes = filelen;
+	parse_stats.lines = pos.line;
 	return 0;
 }
 
@@ -361,6 +820,22 @@ static void replace_if_zero(void *dest, void *src, size_t size) {
 	memcpy(dest, src, size);
 }
 
+/*
+ * Add the combinations of [All] to a keymap, unless it has its own
+ */
+static int merge_combos(struct combo_map *map) {
+	int i, j;
+
+	for (i = 0; i < COMBOS_MAX && combomap_all[i].keys; ++i) {
+		for (j = 0; j < COMBOS_MAX && map[j].keys && map[j].keys != combomap_all[i].keys; ++j);
+		if (j < COMBOS_MAX && map[j].keys)
+			continue;
+		if (store_combo(map, combomap_all + i))
+			return -1;
+	}
+	return 0;
+}
+
 static int set_defaults() {
 	int i;
 	for (i = 0; i < XWII_KEY_NUM; ++i) {
@@ -370,6 +845,13 @@ static int set_defaults() {
 			replace_if_zero(keymap_classic + i, keymap_all + i, sizeof(struct map_data));
 		}
 	}
+	for (i = 0; i < AXIS_NUM; ++i) {
+		if (axismap_all[i].out.intype) {
+			replace_if_zero(axismap_core + i, axismap_all + i, sizeof(struct axis_map));
+			replace_if_zero(axismap_nunchuk + i, axismap_all + i, sizeof(struct axis_map));
+			replace_if_zero(axismap_classic + i, axismap_all + i, sizeof(struct axis_map));
+		}
+	}
 	if (controller_all.name) {
 		replace_if_zero(&controller_core.name, &controller_all.name, sizeof(controller_all.name));
 		replace_if_zero(&controller_nunchuk.name, &controller_all.name, sizeof(controller_all.name));
@@ -385,29 +867,483 @@ static int set_defaults() {
 		replace_if_zero(&controller_nunchuk.product, &controller_all.product, sizeof(controller_all.product));
 		replace_if_zero(&controller_classic.product, &controller_all.product, sizeof(controller_all.product));
 	}
+	if (merge_combos(combomap_core) || merge_combos(combomap_nunchuk)
+			|| merge_combos(combomap_classic))
+		return -1;
+	return 0;
 }
 
-ssize_t read_config(const char *path) {
-	int fd = open(path, O_RDONLY);
-	if (-1 == fd)
-		return errno;
-	
+/*
+ * Convert a key mapping into the entry used to translate its events
+ */
+static int compile_key(const struct map_data *map, struct key_entry *entry,
+		const struct macro_step *steps) {
+	int reversed = map->reversed;
+
+	memset(entry, 0, sizeof(*entry));
+	switch (map->intype) {
+	case IN_TYPE_NONE:
+		break;
+	case IN_TYPE_KEY_OR_BTN:
+		// Repeats are ignored
+		entry->type = EV_KEY;
+		entry->code = map->input;
+		entry->states = 1 << 0 | 1 << 1;
+		entry->value[0] = reversed;
+		entry->value[1] = !reversed;
+		if (map->turbo)
+			entry->turbo_ns = 500000000 / map->turbo;
+		break;
+	case IN_TYPE_ABS:
+		entry->type = EV_ABS;
+		entry->code = map->input;
+		entry->states = 1 << 0 | 1 << 1 | 1 << 2;
+		entry->value[0] = 0;
+		entry->value[1] = reversed ? -ABSMAX : ABSMAX;
+		entry->value[2] = entry->value[1];
+		break;
+	case IN_TYPE_MACRO:
+		// Only started by a press, so no state writes an event
+		entry->macro = steps + map->macro;
+		entry->macro_len = map->macro_len;
+		break;
+	case IN_TYPE_REL:
+		map_error(map, "REL inputs are unsupported");
+		return -EINVAL;
+	default:
+		map_error(map, "Unsupported input type %d", map->intype);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Convert a keymap into the table used to translate key events
+ */
+static int compile_keymap(const struct map_data *map, struct key_entry *table,
+		const struct macro_step *steps) {
+	int i;
+	int ret;
+
+	for (i = 0; i < XWII_KEY_NUM; ++i) {
+		if ((ret = compile_key(map + i, table + i, steps)))
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Build the lookup of each Wii key: for every combination of its partners
+ * being held, the largest combination its press completes. Ties go to the
+ * combination listed first.
+ */
+static int compile_combos(const struct combo_map *map, struct combo_table *table,
+		const struct macro_step *steps) {
+	struct combo_key *ck;
+	uint32_t held;
+	int c, best, k, j, i;
+	int ret;
+
+	memset(table, 0, sizeof(*table));
+	for (c = 0; c < COMBOS_MAX && map[c].keys; ++c) {
+		table->keys[c] = map[c].keys;
+		if ((ret = compile_key(&map[c].out, table->outputs + c, steps)))
+			return ret;
+
+		for (k = 0; k < XWII_KEY_NUM; ++k) {
+			if (!(map[c].keys & 1u << k))
+				continue;
+			ck = table->by_key + k;
+			for (j = 0; j < XWII_KEY_NUM; ++j) {
+				if (j == k || !(map[c].keys & 1u << j))
+					continue;
+				for (i = 0; i < ck->partners_len && ck->partners[i] != j; ++i);
+				if (i < ck->partners_len)
+					continue;
+				if (COMBO_KEYS == ck->partners_len) {
+					map_error(&map[c].out, "%s is combined with more than %d other keys",
+							wii_key_map[k].key, COMBO_KEYS);
+					return -EINVAL;
+				}
+				ck->partners[ck->partners_len++] = j;
+			}
+		}
+	}
+
+	for (k = 0; k < XWII_KEY_NUM; ++k) {
+		ck = table->by_key + k;
+		for (i = 0; i < 1 << ck->partners_len; ++i) {
+			held = 1u << k;
+			for (j = 0; j < ck->partners_len; ++j) {
+				if (i & 1 << j)
+					held |= 1u << ck->partners[j];
+			}
+
+			best = -1;
+			for (c = 0; c < COMBOS_MAX && table->keys[c]; ++c) {
+				if ((table->keys[c] & 1u << k) && !(table->keys[c] & ~held)
+						&& (-1 == best || __builtin_popcount(table->keys[c])
+						> __builtin_popcount(table->keys[best])))
+					best = c;
+			}
+			ck->combo[i] = best + 1;
+		}
+	}
+	return 0;
+}
 
+/*
+ * Convert analog mappings into the tables used to filter samples
+ */
+#define POINTER_CUTOFF 1.0f // Hz
+#define POINTER_BETA 0.01f
+
+/*
+ * Response of an axis to a magnitude from 0 to 1, as a magnitude from 0 to 1
+ */
+static float response(const struct axis_map *map, float t) {
+	float x0 = 0, y0 = 0, x1 = 1, y1 = 1, e;
+	int i;
+
+	if (map->expo) {
+		e = map->expo / 1000.f;
+		return (1 - e) * t + e * t * t * t;
+	}
+	for (i = 0; i < map->curve_len; ++i) {
+		x1 = map->curve[i][0] / 100.f;
+		y1 = map->curve[i][1] / 100.f;
+		if (t <= x1)
+			break;
+		x0 = x1;
+		y0 = y1;
+	}
+	if (i == map->curve_len) {
+		x1 = 1;
+		y1 = 1;
+	}
+	return y0 + (t - x0) * (y1 - y0) / (x1 - x0);
+}
+
+/*
+ * Apply the response curve to an axis value, at load time
+ */
+static int32_t shape(const struct axis_map *map, const struct axis_entry *entry, int32_t value) {
+	int32_t magnitude = abs(value) < entry->max ? abs(value) : entry->max;
+
+	if (!map->expo && !map->curve_len)
+		return value;
+	magnitude = lroundf(response(map, (float) magnitude / entry->max) * entry->max);
+	return value < 0 ? -magnitude : magnitude;
+}
+
+/*
+ * Sample the response curve for the event loop, which interpolates between
+ * the samples in fixed point
+ */
+static int16_t *compile_curve(const struct axis_map *map, struct axis_entry *entry) {
+	int16_t *curve = malloc((CURVE_SIZE + 1) * sizeof(*curve));
+	int i;
+
+	if (!curve)
+		return NULL;
+	for (i = 0; i <= CURVE_SIZE; ++i)
+		curve[i] = lroundf(response(map, (float) i / CURVE_SIZE) * entry->max);
+	entry->curve_scale = ((int64_t) CURVE_SIZE << 16) / entry->max;
+	return curve;
+}
+
+/*
+ * Precompute the axis value of every raw sample: centering, deadzone, scale,
+ * reversal, response curve and clamping all become one lookup
+ */
+static int16_t *compile_lut(const struct axis_map *map, const struct axis_entry *entry,
+		unsigned int flags) {
+	int16_t *lut = malloc(AXIS_LUT_SIZE * sizeof(*lut));
+	int32_t raw, x, value;
+
+	if (!lut)
+		return NULL;
+
+	for (raw = -AXIS_LUT_SIZE / 2; raw < AXIS_LUT_SIZE / 2; ++raw) {
+		x = raw - map->center;
+		if (x > map->deadzone)
+			x -= map->deadzone;
+		else if (x < -map->deadzone)
+			x += map->deadzone;
+		else
+			x = 0;
+		if ((flags & AXIS_UNSIGNED) && x < 0)
+			x = 0;
+
+		value = shape(map, entry, axis_scale(entry, (int64_t) abs(x) << AXIS_FRAC_BITS));
+		if (x < 0)
+			value = -value;
+		if ((flags & AXIS_UNSIGNED) && map->out.reversed)
+			value = entry->max + value;
+		lut[raw + AXIS_LUT_SIZE / 2] = axis_clamp(entry, value);
+	}
+	return lut;
+}
+
+static int compile_axes(const struct axis_map *map, struct axis_entry *table) {
+	int i;
+	for (i = 0; i < AXIS_NUM; ++i) {
+		struct axis_entry *entry = table + i;
+		int32_t range = map[i].range ? map[i].range : axis_source_map[i].range;
+		int32_t max = map[i].max ? map[i].max : axis_source_map[i].max;
+		int64_t scale;
+
+		switch (map[i].out.intype) {
+		case IN_TYPE_NONE:
+			continue;
+		case IN_TYPE_ABS:
+			entry->type = EV_ABS;
+			break;
+		case IN_TYPE_REL:
+			if (axis_source_map[i].flags & AXIS_RELATIVE) {
+				entry->type = EV_REL;
+				break;
+			}
+			// No break
+		default:
+			map_error(&map[i].out, "%s must be mapped to an ABS axis", axis_source_map[i].name);
+			return -EINVAL;
+		}
+
+		if (map[i].deadzone >= range) {
+			map_error(&map[i].out, "Deadzone of %s must be less than its range",
+					axis_source_map[i].name);
+			return -EINVAL;
+		}
+		scale = ((int64_t) max << 16) / (range - map[i].deadzone);
+		if (max > INT16_MAX || scale > INT32_MAX) {
+			map_error(&map[i].out, "Max of %s is too large for its range",
+					axis_source_map[i].name);
+			return -EINVAL;
+		}
+
+		entry->code = map[i].out.input;
+		entry->smoothing = map[i].smoothing < 16 ? map[i].smoothing : 16;
+		entry->deadzone = map[i].deadzone << AXIS_FRAC_BITS;
+		entry->scale = map[i].out.reversed ? -scale : scale;
+		entry->max = max;
+		entry->min = axis_source_map[i].flags & AXIS_UNSIGNED ? 0 : -max;
+		entry->cutoff = map[i].cutoff ? map[i].cutoff / 1e6f : POINTER_CUTOFF;
+		entry->beta = map[i].beta ? map[i].beta / 1e6f : POINTER_BETA;
+		entry->predict = map[i].predict / 1e3f;
+		entry->fuzz = map[i].fuzz ? map[i].fuzz - 1 : ABSFUZZ;
+		entry->flat = map[i].flat ? map[i].flat - 1 : ABSFLAT;
+
+		if (axis_source_map[i].flags & AXIS_LUT) {
+			entry->lut = compile_lut(map + i, entry, axis_source_map[i].flags);
+			if (!entry->lut)
+				return -ENOMEM;
+		} else if (EV_ABS == entry->type && (map[i].expo || map[i].curve_len)) {
+			entry->curve = compile_curve(map + i, entry);
+			if (!entry->curve)
+				return -ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Forget the config read last, so that the next one starts from nothing
+ */
+static void clear_config() {
+	arena_free(&config_arena);
+	memset(&controller_core, 0, sizeof(controller_core));
+	memset(&controller_nunchuk, 0, sizeof(controller_nunchuk));
+	memset(&controller_classic, 0, sizeof(controller_classic));
+	memset(&controller_all, 0, sizeof(controller_all));
+
+	memset(keymap_core, 0, sizeof(keymap_core));
+	memset(keymap_nunchuk, 0, sizeof(keymap_nunchuk));
+	memset(keymap_classic, 0, sizeof(keymap_classic));
+	memset(keymap_all, 0, sizeof(keymap_all));
+	memset(axismap_core, 0, sizeof(axismap_core));
+	memset(axismap_nunchuk, 0, sizeof(axismap_nunchuk));
+	memset(axismap_classic, 0, sizeof(axismap_classic));
+	memset(axismap_all, 0, sizeof(axismap_all));
+	memset(combomap_core, 0, sizeof(combomap_core));
+	memset(combomap_nunchuk, 0, sizeof(combomap_nunchuk));
+	memset(combomap_classic, 0, sizeof(combomap_classic));
+	memset(combomap_all, 0, sizeof(combomap_all));
+	macro_steps_len = 0;
+}
+
+static int compile_controller(const struct controller_data *data,
+		struct controller_data *controller) {
+	*controller = *data;
+	if (data->name && !(controller->name = strdup(data->name)))
+		return -ENOMEM;
+	return 0;
+}
+
+/*
+ * Move the ABS_ outputs of keys to the end of the axis on the same code, if
+ * there is one, so that they stay within its range
+ */
+static void fit_abs_keys(struct key_entry *table, int len, const struct axis_entry *axes) {
+	int i, j;
+
+	for (i = 0; i < len; ++i) {
+		if (EV_ABS != table[i].type)
+			continue;
+		for (j = 0; j < AXIS_NUM; ++j) {
+			if (EV_ABS == axes[j].type && axes[j].code == table[i].code)
+				break;
+		}
+		if (j == AXIS_NUM)
+			continue;
+		table[i].value[1] = table[i].value[1] < 0 ? axes[j].min : axes[j].max;
+		table[i].value[2] = table[i].value[1];
+	}
+}
+
+static int compile_extension(const struct map_data *keymap, const struct combo_map *combomap,
+		const struct axis_map *axismap, const struct controller_data *controller,
+		struct keymap *out, const struct macro_step *steps) {
+	int ret;
+
+	if ((ret = compile_keymap(keymap, out->keys, steps))
+			|| (ret = compile_combos(combomap, &out->combos, steps))
+			|| (ret = compile_axes(axismap, out->axes))
+			|| (ret = compile_controller(controller, &out->controller)))
+		return ret;
+	fit_abs_keys(out->keys, XWII_KEY_NUM, out->axes);
+	fit_abs_keys(out->combos.outputs, COMBOS_MAX, out->axes);
+	return 0;
+}
+
+/*
+ * Compile the config just read into a new set of keymaps
+ */
+static int compile_keymaps(struct keymaps **keymaps) {
+	struct keymaps *compiled = calloc(1, sizeof(*compiled));
+	int ret;
+
+	if (!compiled)
+		return -ENOMEM;
+	memcpy(compiled->macro_steps, macro_steps, macro_steps_len * sizeof(*macro_steps));
+
+	if ((ret = compile_extension(keymap_core, combomap_core, axismap_core, &controller_core,
+				&compiled->core, compiled->macro_steps))
+			|| (ret = compile_extension(keymap_nunchuk, combomap_nunchuk, axismap_nunchuk,
+				&controller_nunchuk, &compiled->nunchuk, compiled->macro_steps))
+			|| (ret = compile_extension(keymap_classic, combomap_classic, axismap_classic,
+				&controller_classic, &compiled->classic, compiled->macro_steps))) {
+		free_keymaps(compiled);
+		return ret;
+	}
+	*keymaps = compiled;
+	return 0;
+}
+
+static void free_keymap(struct keymap *keymap) {
+	int i;
+
+	for (i = 0; i < AXIS_NUM; ++i) {
+		free((void *) keymap->axes[i].lut);
+		free((void *) keymap->axes[i].curve);
+	}
+	free(keymap->controller.name);
+}
+
+void free_keymaps(struct keymaps *keymaps) {
+	if (!keymaps)
+		return;
+	free_keymap(&keymaps->core);
+	free_keymap(&keymaps->nunchuk);
+	free_keymap(&keymaps->classic);
+	free(keymaps);
+}
+
+/*
+ * Parse a config and apply its defaults, timing both into parse_stats
+ */
+static ssize_t parse_timed(const char *file, size_t filelen) {
+	int64_t start_ns = time_ns();
+	ssize_t ret;
+
+	ret = parse_config(file, filelen);
+	if (!ret && set_defaults())
+		ret = -EINVAL;
+	parse_stats.ns = time_ns() - start_ns;
+	return ret;
+}
+
+static ssize_t load_config(const char *path, int compile, struct keymaps **keymaps) {
 	struct stat statbuf;
-	fstat(fd, &statbuf);
-	size_t filelen = statbuf.st_size;
-	
-	// Map entire file (dangerous?)
-	char * const file = mmap(NULL, filelen, PROT_READ, MAP_PRIVATE, fd, 0);
+	char *file = NULL;
+	size_t filelen;
+	ssize_t ret;
+	int cached = false;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (-1 == fd)
+		return -errno;
+
+	if (-1 == fstat(fd, &statbuf)) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	filelen = statbuf.st_size;
+
+	// An empty file can't be mapped, and has nothing to parse
+	if (filelen) {
+		file = mmap(NULL, filelen, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED == file) {
+			ret = -errno;
+			close(fd);
+			return ret;
+		}
+	}
 
-	ssize_t ret = parse_config(file, filelen);
+	clear_config();
+	if (!compile) {
+		ret = load_config_cache(path, file, filelen, &statbuf);
+		if (ret < 0)
+			fprintf(stderr, "Unable to read cache for %s\n", path);
+		cached = !ret;
+	}
+
+	if (!cached) {
+		ret = parse_timed(file, filelen);
+		if (!ret) {
+			if (compile)
+				ret = write_config_cache(path, file, filelen, &statbuf);
+		}
+	}
 
-	if (-1 == munmap(file, filelen))
+	if (file && -1 == munmap(file, filelen))
 		return -errno;
 	if (-1 == close(fd))
 		return -errno;
 
-	set_defaults();
+	if (ret)
+		return ret;
 
-	return ret;
+	return compile_keymaps(keymaps);
+}
+
+ssize_t read_config(const char *path, struct keymaps **keymaps) {
+	return load_config(path, false, keymaps);
+}
+
+ssize_t parse_config_buffer(const char *config, size_t len, struct keymaps **keymaps) {
+	ssize_t ret;
+
+	clear_config();
+	ret = parse_timed(config, len);
+	if (ret)
+		return ret;
+
+	return compile_keymaps(keymaps);
+}
+
+ssize_t compile_config(const char *path, struct keymaps **keymaps) {
+	return load_config(path, true, keymaps);
 }
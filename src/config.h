@@ -1,17 +1,153 @@
 #ifndef __W2G_CONFIG_H
 #define __W2G_CONFIG_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <xwiimote.h>
+
+#define ABSMAX 98
+#define ABSFUZZ 2 // Default fuzz and flat of ABS axes
+#define ABSFLAT 4
+#define KEY_STATE_NUM 3 // Released, pressed and repeated
+#define AXIS_LUT_SIZE 256 // Raw values covered by a calibration table, centered on 0
+#define CURVE_POINTS 8 // Points of a custom response curve
+#define CURVE_SIZE 64 // Segments of a compiled response curve
+#define MACRO_KEYS 4 // Keys held at once by a macro step
+#define MACRO_STEPS 256 // Steps of every macro in a config
+#define TURBO_MAX 500 // Hz
+#define COMBOS_MAX 32 // Combinations in a keymap
+#define COMBO_KEYS 4 // Other keys a Wii key may be combined with
+
 enum input_type {
 	IN_TYPE_NONE,
 	IN_TYPE_KEY_OR_BTN,
 	IN_TYPE_REL,
-	IN_TYPE_ABS
+	IN_TYPE_ABS,
+	IN_TYPE_MACRO // Steps macro to macro + macro_len of macro_steps
 };
 
 struct map_data {
 	enum input_type intype;
 	unsigned int input;
 	int reversed; // bool
+	uint16_t turbo; // Presses per second while held, 0 for none
+	uint16_t macro, macro_len;
+	uint32_t line, column; // Where it was mapped, for errors found when compiling
+};
+
+/*
+ * One step of a macro: keys held for a time, or a pause if len is 0
+ */
+struct macro_step {
+	uint16_t codes[MACRO_KEYS];
+	uint16_t len;
+	uint16_t ms;
+};
+
+/*
+ * A map_data compiled for the event loop. Holds the event written for each
+ * state of a Wii key.
+ */
+struct key_entry {
+	uint16_t type; // 0 if unmapped
+	uint16_t code;
+	unsigned int states; // Bit n is set if state n writes an event
+	int32_t value[KEY_STATE_NUM];
+	uint32_t turbo_ns; // Half of the turbo period, 0 for none
+	const struct macro_step *macro; // Played on press instead, or NULL
+	unsigned int macro_len;
+};
+
+/*
+ * A combination of Wii keys with its own output, such as a chord or a shift
+ * layer
+ */
+struct combo_map {
+	uint32_t keys; // Bit n is set for Wii key n, 0 if unused
+	struct map_data out;
+};
+
+/*
+ * Combinations compiled for the event loop. For each Wii key, the held state
+ * of the keys it is combined with indexes the combination it completes.
+ */
+struct combo_key {
+	uint8_t partners[COMBO_KEYS];
+	uint8_t partners_len;
+	uint8_t combo[1 << COMBO_KEYS]; // 1 + index in outputs, 0 for none
+};
+
+struct combo_table {
+	uint32_t keys[COMBOS_MAX]; // Keys of each combination
+	struct key_entry outputs[COMBOS_MAX];
+	struct combo_key by_key[XWII_KEY_NUM];
+};
+
+/*
+ * Analog sources which may be mapped to an axis
+ */
+enum axis_source {
+	AXIS_ACCEL_X,
+	AXIS_ACCEL_Y,
+	AXIS_ACCEL_Z,
+	AXIS_ACCEL_ROLL, // Rotation around the pointing direction, in degrees
+	AXIS_ACCEL_PITCH, // Tilt of the tip up or down, in degrees
+	AXIS_IR_X, // Pointer position, in IR camera pixels from the center
+	AXIS_IR_Y,
+	AXIS_IR_ROLL, // Rotation measured from the IR sources, in degrees
+	AXIS_MP_ROLL, // Orientation from the MotionPlus, in degrees
+	AXIS_MP_PITCH,
+	AXIS_MP_YAW,
+	AXIS_CLASSIC_LX, // Classic Controller sticks, in raw units from the center
+	AXIS_CLASSIC_LY,
+	AXIS_CLASSIC_RX,
+	AXIS_CLASSIC_RY,
+	AXIS_CLASSIC_LT, // Classic Controller triggers, from 0
+	AXIS_CLASSIC_RT,
+	AXIS_NUNCHUK_X, // Nunchuk stick, in raw units from the center
+	AXIS_NUNCHUK_Y,
+	AXIS_NUM
+};
+
+struct axis_map {
+	struct map_data out; // out.intype is IN_TYPE_NONE if unmapped
+	int32_t range; // Source value at the end of the axis, 0 for the default
+	int32_t deadzone; // In source units
+	int32_t smoothing; // Low-pass strength, 0 for none
+	int32_t max; // Largest value of the axis, 0 for the default
+	int32_t center; // Raw value at rest, for sources with a calibration table
+	// Pointer filter, 0 for the defaults
+	int32_t cutoff; // Minimum cutoff frequency, in millionths of a Hz
+	int32_t beta; // Cutoff increase per unit/s, in millionths
+	int32_t predict; // Extrapolation, in ms
+	// Advertised to readers of the axis
+	int32_t fuzz; // Plus one, 0 for the default
+	int32_t flat; // Plus one, 0 for the default
+	// Response curve, linear if neither is given
+	int32_t expo; // Blend of a cubic into the response, in thousandths
+	int32_t curve_len;
+	int16_t curve[CURVE_POINTS][2]; // Input and output, in percent of the range and the axis
+};
+
+/*
+ * An axis_map compiled for the event loop. Samples are filtered in fixed
+ * point with AXIS_FRAC_BITS fractional bits.
+ */
+struct axis_entry {
+	uint16_t type; // 0 if unmapped
+	uint16_t code;
+	uint32_t smoothing; // The low-pass filter moves by 2^-smoothing per sample
+	int32_t deadzone;
+	int32_t scale; // Output units per source unit, Q16, negative if reversed
+	int32_t min, max;
+	const int16_t *lut; // Calibration table for raw samples, or NULL
+	const int16_t *curve; // Response at CURVE_SIZE + 1 points from 0 to max, or NULL
+	int32_t curve_scale; // Curve points per unit, Q16
+	int32_t fuzz, flat;
+	float cutoff; // Hz
+	float beta;
+	float predict; // Seconds
 };
 
 struct controller_data {
@@ -20,6 +156,55 @@ struct controller_data {
 	int product;
 };
 
-ssize_t read_config(const char *path);
+/*
+ * The tables the events of one extension are translated with
+ */
+struct keymap {
+	struct key_entry keys[XWII_KEY_NUM];
+	struct axis_entry axes[AXIS_NUM];
+	struct combo_table combos;
+	struct controller_data controller;
+};
+
+/*
+ * Every keymap of a config, compiled for the event loop. Nothing in it refers
+ * to the parsed config, so a config can be reloaded while it is in use.
+ */
+struct keymaps {
+	struct keymap core, nunchuk, classic;
+	struct macro_step macro_steps[MACRO_STEPS]; // Played by the keys' macros
+};
+
+/*
+ * Size of the config file parsed last, and the time taken to parse it and
+ * apply its defaults
+ */
+struct parse_stats {
+	size_t bytes;
+	size_t lines;
+	int64_t ns;
+};
+
+extern struct parse_stats parse_stats;
+
+/*
+ * Read the keymaps from a config file, or from its cache if the cache is up
+ * to date, and compile them into *keymaps. Returns 0 on success, a positive
+ * line number on a parse error or a negative error code.
+ */
+ssize_t read_config(const char *path, struct keymaps **keymaps);
+
+/*
+ * Parse a config held in memory, which needn't end in a newline or a NUL,
+ * without using a cache
+ */
+ssize_t parse_config_buffer(const char *config, size_t len, struct keymaps **keymaps);
+
+/*
+ * Parse a config file and write its cache
+ */
+ssize_t compile_config(const char *path, struct keymaps **keymaps);
+
+void free_keymaps(struct keymaps *keymaps);
 
 #endif // __W2G_CONFIG_H
@@ -0,0 +1,91 @@
+#ifndef __W2G_DEVICE_H
+#define __W2G_DEVICE_H
+
+#include <stdint.h>
+
+#include <libevdev/libevdev-uinput.h>
+#include <xwiimote.h>
+
+#include "axis.h"
+#include "config.h"
+#include "loop.h"
+#include "motion.h"
+#include "pointer.h"
+#include "wheel.h"
+
+#define FRAME_MAX 64 // Events buffered before a flush
+
+struct device;
+
+/*
+ * Turbo or macro of a Wii key, played while its timer is pending
+ */
+struct key_timer {
+	struct timer timer;
+	struct device *dev;
+	const struct key_entry *entry;
+	int64_t due_ns; // When the timer is due
+	unsigned int step; // Macro step being played
+	int on; // Turbo output is pressed
+};
+
+/*
+ * A Wiimote and the virtual gamepad it drives. The keymap tables themselves
+ * are shared by every device.
+ */
+struct device {
+	struct source source; // Readable when iface has events
+	int num; // Wiimote number, as given on the command line
+	char *path;
+	struct xwii_iface *iface;
+	struct libevdev_uinput *uinput_dev;
+
+	// Active keymap
+	const struct keymap *keymap;
+	unsigned int ifaces; // Interfaces it was selected for
+
+	// Combinations
+	uint32_t keys_held; // Bit n is set while Wii key n is held
+	uint32_t keys_absorbed; // Held keys whose output is a combination's
+	uint32_t combos_active; // Bit n is set while combination n is pressed
+
+	struct axis_state axes[AXIS_NUM];
+	struct pointer_state pointer;
+	struct motion_state motion;
+
+	// Output frame, written to the output with a single write()
+	struct input_event frame[FRAME_MAX];
+	int frame_len;
+	int frame_pending; // Events were emitted since the last SYN_REPORT
+	unsigned int frame_keys; // Wii keys written since the last SYN_REPORT
+
+	// Wiimote events with output in the frame, for latency measurement
+	struct {
+		unsigned int type;
+		int64_t usec; // Kernel timestamp
+	} frame_sources[FRAME_MAX];
+	int frame_sources_len;
+	const struct xwii_event *event; // Event being translated
+
+	// Reopening interfaces after an extension change. Events keep being
+	// translated with the previous keymap in the meantime.
+	int selected; // A keymap was selected, or queued for the emitter
+	struct source reopen_source; // timerfd, fires at the next attempt
+	// Read and counted by the emitter as well with -t, so accessed atomically
+	int reopen_tries; // 0 when not reopening
+	int64_t reopen_start_ns;
+	unsigned long reopen_events; // Events handled while reopening
+	unsigned long reopen_dropped; // Of those, events with no output
+
+	// Turbo and macros
+	struct key_timer key_timers[XWII_KEY_NUM];
+	int timer_synced; // On the list of devices written to by timers
+	struct device *timer_next;
+
+	int gone; // Disconnected, remove once the current batch is done
+	int64_t appeared_ns; // Hotplug time, cleared once an event is forwarded
+
+	struct device *next;
+};
+
+#endif // __W2G_DEVICE_H
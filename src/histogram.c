@@ -0,0 +1,34 @@
+#include "histogram.h"
+
+/*
+ * Largest value counted in the given bucket
+ */
+static uint64_t bucket_max(unsigned int bucket) {
+	unsigned int shift;
+
+	if (bucket < 2u << HIST_SUB_BITS)
+		return bucket;
+
+	shift = (bucket >> HIST_SUB_BITS) - 1;
+	return ((uint64_t) ((bucket & ((1u << HIST_SUB_BITS) - 1)) + (1u << HIST_SUB_BITS) + 1) << shift) - 1;
+}
+
+uint64_t hist_percentile(const struct histogram *hist, double fraction) {
+	uint64_t count = __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+	uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+	uint64_t target, seen = 0;
+	unsigned int i;
+
+	if (!count)
+		return 0;
+	target = fraction * count;
+	if (target < 1)
+		target = 1;
+
+	for (i = 0; i < HIST_BUCKETS; ++i) {
+		seen += __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+		if (seen >= target)
+			return bucket_max(i) < max ? bucket_max(i) : max;
+	}
+	return max;
+}
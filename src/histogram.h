@@ -0,0 +1,51 @@
+#ifndef __W2G_HISTOGRAM_H
+#define __W2G_HISTOGRAM_H
+
+#include <stdint.h>
+
+/*
+ * Fixed-size log-linear histogram. Values below 2^(HIST_SUB_BITS + 1) are
+ * counted exactly; above that, each power of two is split into
+ * 2^HIST_SUB_BITS buckets, for a relative error of about 3%. Values of
+ * 2^HIST_MAX_BITS or more are counted in the last bucket.
+ *
+ * hist_record() never allocates or blocks. Counters are updated atomically,
+ * so the histogram may be read while it is being recorded to.
+ */
+
+#define HIST_SUB_BITS 5
+#define HIST_MAX_BITS 26
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+
+struct histogram {
+	uint64_t count;
+	uint64_t max;
+	uint32_t buckets[HIST_BUCKETS];
+};
+
+static inline unsigned int hist_bucket(uint64_t value) {
+	unsigned int shift;
+
+	if (value >> HIST_MAX_BITS)
+		value = (1ull << HIST_MAX_BITS) - 1;
+	if (value < 2u << HIST_SUB_BITS)
+		return value;
+
+	shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+	return (shift << HIST_SUB_BITS) + (value >> shift);
+}
+
+static inline void hist_record(struct histogram *hist, uint64_t value) {
+	__atomic_fetch_add(&hist->buckets[hist_bucket(value)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+	// Only one thread records to a histogram
+	if (value > __atomic_load_n(&hist->max, __ATOMIC_RELAXED))
+		__atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Upper bound of the bucket holding the given fraction of values
+ */
+uint64_t hist_percentile(const struct histogram *hist, double fraction);
+
+#endif // __W2G_HISTOGRAM_H
@@ -0,0 +1,117 @@
+#include "loop.h"
+
+#include <errno.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define MAX_EPOLL_EVENTS 16
+
+static int epoll_fd = -1;
+
+// Sources ready in the current loop_wait() call
+static struct epoll_event events[MAX_EPOLL_EVENTS];
+static int num_events;
+
+enum loop_backend loop_backend = LOOP_EPOLL;
+unsigned long loop_syscalls;
+
+int loop_init(enum loop_backend backend) {
+	if (LOOP_URING == backend && !uring_init()) {
+		loop_backend = LOOP_URING;
+		return 0;
+	}
+
+	loop_backend = LOOP_EPOLL;
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (-1 == epoll_fd)
+		return -errno;
+	return 0;
+}
+
+void loop_close() {
+	if (LOOP_URING == loop_backend) {
+		uring_close();
+		return;
+	}
+	if (-1 != epoll_fd) {
+		close(epoll_fd);
+		epoll_fd = -1;
+	}
+}
+
+int loop_add(struct source *source) {
+	struct epoll_event epev = {
+		.events = EPOLLIN,
+		.data.ptr = source,
+	};
+
+	if (LOOP_URING == loop_backend)
+		return uring_add(source);
+
+	if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, source->fd, &epev))
+		return -errno;
+	return 0;
+}
+
+void loop_remove(struct source *source) {
+	int i;
+
+	if (LOOP_URING == loop_backend) {
+		uring_remove(source);
+		return;
+	}
+	if (-1 == epoll_fd)
+		return;
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+
+	// The source may be removed while other sources are being dispatched
+	for (i = 0; i < num_events; ++i) {
+		if (events[i].data.ptr == source)
+			events[i].data.ptr = NULL;
+	}
+}
+
+int loop_wait(const sigset_t *sigmask) {
+	struct source *source;
+	int i;
+
+	if (LOOP_URING == loop_backend)
+		return uring_wait(sigmask);
+
+	__atomic_add_fetch(&loop_syscalls, 1, __ATOMIC_RELAXED);
+	num_events = epoll_pwait(epoll_fd, events, MAX_EPOLL_EVENTS, -1, sigmask);
+	if (-1 == num_events) {
+		num_events = 0;
+		return -errno;
+	}
+
+	for (i = 0; i < num_events; ++i) {
+		source = events[i].data.ptr;
+		if (source)
+			source->dispatch(source);
+	}
+	i = num_events;
+	num_events = 0;
+	return i;
+}
+
+int loop_write(int fd, const void *buf, size_t len) {
+	ssize_t ret;
+
+	if (LOOP_URING == loop_backend)
+		return uring_write(fd, buf, len);
+
+	__atomic_add_fetch(&loop_syscalls, 1, __ATOMIC_RELAXED);
+	ret = write(fd, buf, len);
+	if (-1 == ret)
+		return -errno;
+	return (size_t) ret == len ? 0 : -EIO;
+}
+
+int loop_flush() {
+	if (LOOP_URING == loop_backend)
+		return uring_flush();
+	return 0;
+}
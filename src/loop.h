@@ -0,0 +1,56 @@
+#ifndef __W2G_LOOP_H
+#define __W2G_LOOP_H
+
+#include <signal.h>
+#include <stddef.h>
+
+/*
+ * A file descriptor waited on by the event loop. dispatch() is called
+ * whenever fd is readable.
+ */
+struct source {
+	int fd;
+	void (*dispatch)(struct source *source);
+	unsigned int id; // Used by the io_uring backend
+};
+
+enum loop_backend {
+	LOOP_EPOLL,
+	LOOP_URING
+};
+
+// Backend in use
+extern enum loop_backend loop_backend;
+
+// epoll_pwait(), write() and io_uring_enter() calls made by the loop. With -t
+// the reader and the emitter both count, so it is updated atomically.
+extern unsigned long loop_syscalls;
+
+/*
+ * Create the event loop. Falls back to epoll if io_uring is unavailable.
+ */
+int loop_init(enum loop_backend backend);
+void loop_close();
+
+int loop_add(struct source *source);
+void loop_remove(struct source *source);
+
+/*
+ * Wait for sources to become readable and dispatch them. Returns the number
+ * of sources dispatched or a negative error code.
+ */
+int loop_wait(const sigset_t *sigmask);
+
+/*
+ * Write buf to fd. With io_uring the write is queued and submitted by the
+ * next loop_wait(), and errors are returned from there. Returns 0 or a
+ * negative error code.
+ */
+int loop_write(int fd, const void *buf, size_t len);
+
+/*
+ * Complete the queued writes, before their file is closed
+ */
+int loop_flush();
+
+#endif // __W2G_LOOP_H
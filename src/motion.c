@@ -0,0 +1,98 @@
+#include "motion.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define GYRO_UNITS_PER_DPS 20.0f
+#define ACCEL_UNITS_PER_G 100
+#define FUSION_TIME_CONSTANT 0.5f // Seconds for the accelerometer to correct drift
+#define MAX_DT 0.1f // Longer gaps aren't integrated
+#define REST_THRESHOLD 60 // Raw units, about 3 degrees/s
+#define REST_SAMPLES 100
+#define REST_TILT 2.0f // Degrees roll and pitch may move while at rest
+
+#define DEGREES(rad) ((rad) * (180.0f / (float) M_PI))
+
+void motion_accel(struct motion_state *state, const struct xwii_event *ev) {
+	const struct xwii_event_abs *abs = &ev->v.abs[0];
+	int32_t norm = abs->x * abs->x + abs->y * abs->y + abs->z * abs->z;
+
+	// Only gravity is a reference, so skip samples taken while swinging
+	state->has_accel = norm > ACCEL_UNITS_PER_G * ACCEL_UNITS_PER_G * 64 / 100
+			&& norm < ACCEL_UNITS_PER_G * ACCEL_UNITS_PER_G * 144 / 100;
+	if (state->has_accel) {
+		state->accel_roll = DEGREES(atan2f(abs->x, abs->z));
+		state->accel_pitch = DEGREES(atan2f(abs->y, abs->z));
+	}
+}
+
+/*
+ * Average the raw rates over REST_SAMPLES samples without motion to find the
+ * bias. Turning at a steady rate also gives steady rates, so roll and pitch
+ * must stay still too, and once calibrated the bias may only move a little.
+ */
+static void calibrate(struct motion_state *state, const int32_t raw[3]) {
+	int still = state->rest_count > 0
+			&& fabsf(state->roll - state->rest_roll) <= REST_TILT
+			&& fabsf(state->pitch - state->rest_pitch) <= REST_TILT;
+	int i;
+
+	for (i = 0; i < 3; ++i) {
+		still = still && abs(raw[i] - state->rest_ref[i]) <= REST_THRESHOLD
+				&& (!state->calibrated || fabsf(raw[i] - state->bias[i]) <= REST_THRESHOLD);
+	}
+
+	if (!still) {
+		// Moving, start over
+		for (i = 0; i < 3; ++i) {
+			state->rest_ref[i] = raw[i];
+			state->rest_sum[i] = 0;
+		}
+		state->rest_roll = state->roll;
+		state->rest_pitch = state->pitch;
+		state->rest_count = 0;
+	}
+
+	for (i = 0; i < 3; ++i)
+		state->rest_sum[i] += raw[i];
+	if (REST_SAMPLES == ++state->rest_count) {
+		for (i = 0; i < 3; ++i)
+			state->bias[i] = (float) state->rest_sum[i] / REST_SAMPLES;
+		state->calibrated = true;
+		state->rest_count = 0;
+	}
+}
+
+void motion_gyro(struct motion_state *state, const struct xwii_event *ev) {
+	const struct xwii_event_abs *abs = &ev->v.abs[0];
+	int64_t usec = (int64_t) ev->time.tv_sec * 1000000 + ev->time.tv_usec;
+	int32_t raw[3] = { abs->x, abs->y, abs->z };
+	float dt, weight;
+
+	calibrate(state, raw);
+
+	if (!state->usec) {
+		state->usec = usec;
+		if (state->has_accel) {
+			state->roll = state->accel_roll;
+			state->pitch = state->accel_pitch;
+		}
+		return;
+	}
+	dt = (usec - state->usec) / 1e6f;
+	state->usec = usec;
+	if (dt <= 0 || dt > MAX_DT)
+		return;
+
+	state->pitch += (raw[0] - state->bias[0]) / GYRO_UNITS_PER_DPS * dt;
+	state->roll += (raw[1] - state->bias[1]) / GYRO_UNITS_PER_DPS * dt;
+	state->yaw += (raw[2] - state->bias[2]) / GYRO_UNITS_PER_DPS * dt;
+
+	// The accelerometer's tilt wraps at 180 degrees, so it is approached the
+	// short way round
+	if (state->has_accel) {
+		weight = dt / (FUSION_TIME_CONSTANT + dt);
+		state->roll += weight * remainderf(state->accel_roll - state->roll, 360);
+		state->pitch += weight * remainderf(state->accel_pitch - state->pitch, 360);
+	}
+}
@@ -0,0 +1,45 @@
+#ifndef __W2G_MOTION_H
+#define __W2G_MOTION_H
+
+#include <stdint.h>
+
+#include <xwiimote.h>
+
+/*
+ * Orientation from the MotionPlus gyroscope, fused with the accelerometer by
+ * a complementary filter. Gyro rates are integrated every sample, and roll
+ * and pitch are pulled towards the accelerometer's tilt to cancel drift. Yaw
+ * has no reference, so it drifts slowly. Each sample takes constant time.
+ *
+ * The gyro bias is calibrated automatically whenever the Wiimote is held
+ * still for about a second.
+ */
+
+struct motion_state {
+	float roll, pitch, yaw; // Degrees, not wrapped
+	int64_t usec; // Time of the last gyro sample, 0 before the first
+
+	// Tilt from the last accelerometer sample, if it was close to 1 g
+	float accel_roll, accel_pitch;
+	int has_accel;
+
+	// Bias calibration
+	float bias[3]; // Raw units
+	int32_t rest_ref[3]; // First sample while at rest
+	float rest_roll, rest_pitch; // Tilt when coming to rest
+	int64_t rest_sum[3];
+	int rest_count;
+	int calibrated;
+};
+
+/*
+ * Note the tilt of an accelerometer sample
+ */
+void motion_accel(struct motion_state *state, const struct xwii_event *ev);
+
+/*
+ * Update the orientation with a MotionPlus sample
+ */
+void motion_gyro(struct motion_state *state, const struct xwii_event *ev);
+
+#endif // __W2G_MOTION_H
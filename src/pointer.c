@@ -0,0 +1,134 @@
+#include "pointer.h"
+
+#include <math.h>
+
+#include "axis.h"
+
+#define IR_SOURCES 4
+#define IR_CENTER_X 512
+#define IR_CENTER_Y 384
+#define DERIVATIVE_CUTOFF 1.0f // Hz
+
+static inline int ir_valid(const struct xwii_event_abs *abs) {
+	return 1023 != abs->x || 1023 != abs->y;
+}
+
+static inline float smoothing_factor(float cutoff, float dt) {
+	float tau = 1.0f / (2.0f * (float) M_PI * cutoff);
+	return 1.0f / (1.0f + tau / dt);
+}
+
+static void one_euro_reset(struct one_euro *filter, float value) {
+	filter->value = value;
+	filter->rate = 0;
+}
+
+/*
+ * Filter a sample dt seconds after the last one and return the extrapolated
+ * value
+ */
+static float one_euro_filter(struct one_euro *filter, const struct axis_entry *entry,
+		float value, float dt) {
+	float rate = (value - filter->value) / dt;
+	float cutoff;
+
+	filter->rate += smoothing_factor(DERIVATIVE_CUTOFF, dt) * (rate - filter->rate);
+	cutoff = entry->cutoff + entry->beta * fabsf(filter->rate);
+	filter->value += smoothing_factor(cutoff, dt) * (value - filter->value);
+
+	return filter->value + filter->rate * entry->predict;
+}
+
+int pointer_update(struct pointer_state *state, const struct xwii_event *ev,
+		const struct axis_entry *x, const struct axis_entry *y,
+		struct pointer_sample *out) {
+	const struct xwii_event_abs *src[2];
+	int64_t usec = (int64_t) ev->time.tv_sec * 1000000 + ev->time.tv_usec;
+	float mid_x, mid_y, len, dx, dy, px, py, dt;
+	int found = 0;
+	int i;
+
+	// xwiimote doesn't report the size of each source, so the first two are
+	// used
+	for (i = 0; i < IR_SOURCES && found < 2; ++i) {
+		if (ir_valid(ev->v.abs + i))
+			src[found++] = ev->v.abs + i;
+	}
+
+	if (!found) {
+		state->tracking = false;
+		return 0;
+	}
+
+	out->has_roll = 2 == found;
+	if (2 == found) {
+		if (src[0]->x > src[1]->x) {
+			const struct xwii_event_abs *tmp = src[0];
+			src[0] = src[1];
+			src[1] = tmp;
+		}
+		state->left_x = src[0]->x;
+		state->left_y = src[0]->y;
+		state->right_x = src[1]->x;
+		state->right_y = src[1]->y;
+		state->sep_x = state->right_x - state->left_x;
+		state->sep_y = state->right_y - state->left_y;
+		mid_x = (state->left_x + state->right_x) / 2;
+		mid_y = (state->left_y + state->right_y) / 2;
+		out->roll = tilt_angle(src[1]->y - src[0]->y, src[1]->x - src[0]->x);
+	} else if (state->sep_x || state->sep_y) {
+		// Assume the other source is where it was relative to this one
+		px = src[0]->x;
+		py = src[0]->y;
+		dx = px - state->left_x;
+		dy = py - state->left_y;
+		len = dx * dx + dy * dy;
+		dx = px - state->right_x;
+		dy = py - state->right_y;
+		if (len <= dx * dx + dy * dy) {
+			state->left_x = px;
+			state->left_y = py;
+			state->right_x = px + state->sep_x;
+			state->right_y = py + state->sep_y;
+		} else {
+			state->right_x = px;
+			state->right_y = py;
+			state->left_x = px - state->sep_x;
+			state->left_y = py - state->sep_y;
+		}
+		mid_x = (state->left_x + state->right_x) / 2;
+		mid_y = (state->left_y + state->right_y) / 2;
+	} else {
+		mid_x = src[0]->x;
+		mid_y = src[0]->y;
+	}
+
+	// Undo the roll, and mirror since the sources move against the pointer
+	dx = mid_x - IR_CENTER_X;
+	dy = mid_y - IR_CENTER_Y;
+	len = sqrtf(state->sep_x * state->sep_x + state->sep_y * state->sep_y);
+	if (len) {
+		px = -(dx * state->sep_x + dy * state->sep_y) / len;
+		py = (dy * state->sep_x - dx * state->sep_y) / len;
+	} else {
+		px = -dx;
+		py = dy;
+	}
+
+	if (!state->tracking) {
+		state->tracking = true;
+		state->usec = usec;
+		one_euro_reset(&state->x, px);
+		one_euro_reset(&state->y, py);
+		out->x = px;
+		out->y = py;
+		return 1;
+	}
+
+	// Reports arrive at 100 Hz
+	dt = usec > state->usec ? (usec - state->usec) / 1e6f : 0.01f;
+	state->usec = usec;
+	out->x = one_euro_filter(&state->x, x, px, dt);
+	out->y = one_euro_filter(&state->y, y, py, dt);
+	return 2;
+}
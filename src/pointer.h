@@ -0,0 +1,51 @@
+#ifndef __W2G_POINTER_H
+#define __W2G_POINTER_H
+
+#include <stdint.h>
+
+#include <xwiimote.h>
+
+#include "config.h"
+
+/*
+ * IR pointer. The two IR sources give the position the Wiimote points at and
+ * its roll, which is compensated for so that twisting the Wiimote doesn't
+ * move the pointer. The position is smoothed by a One-Euro filter, which
+ * filters heavily while the pointer is still and lightly while it moves, and
+ * may be extrapolated to hide report latency.
+ */
+
+// Adaptive low-pass filter, from Casiez et al., "1 Euro Filter", CHI 2012
+struct one_euro {
+	float value;
+	float rate; // Filtered rate of change, per second
+};
+
+struct pointer_state {
+	int tracking; // Sources were visible in the last report
+	int64_t usec; // Time of the last report
+	float sep_x, sep_y; // From the left source to the right one
+	float left_x, left_y, right_x, right_y; // Last sources, in camera pixels
+	struct one_euro x, y;
+};
+
+/*
+ * A pointer sample. x and y are in camera pixels from the center and roll is
+ * in degrees with AXIS_FRAC_BITS fractional bits.
+ */
+struct pointer_sample {
+	float x, y;
+	int32_t roll;
+	int has_roll; // Both sources were visible
+};
+
+/*
+ * Update the pointer with an IR report. x and y are the filter settings of
+ * each coordinate. Returns 0 if no source is visible, 1 if the pointer was
+ * just found and 2 if it was tracked from the last report.
+ */
+int pointer_update(struct pointer_state *state, const struct xwii_event *ev,
+		const struct axis_entry *x, const struct axis_entry *y,
+		struct pointer_sample *out);
+
+#endif // __W2G_POINTER_H
@@ -0,0 +1,68 @@
+#define _GNU_SOURCE
+#include "realtime.h"
+
+#include <errno.h>
+#include <malloc.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define PREFAULT_STACK (256 * 1024)
+#define PREFAULT_HEAP (1024 * 1024)
+
+/*
+ * Touch the stack the event loop will use. Not inlined so the array is
+ * really on the stack below the caller.
+ */
+static __attribute__((noinline)) void prefault_stack() {
+	volatile char stack[PREFAULT_STACK];
+	size_t i;
+
+	for (i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+/*
+ * Grow the heap and keep it, so later allocations (hotplugged Wiimotes,
+ * libevdev devices) are served from locked pages
+ */
+static int prefault_heap() {
+	char *heap;
+
+	if (!mallopt(M_TRIM_THRESHOLD, -1) || !mallopt(M_MMAP_MAX, 0))
+		return -EINVAL;
+
+	heap = malloc(PREFAULT_HEAP);
+	if (!heap)
+		return -ENOMEM;
+	memset(heap, 0, PREFAULT_HEAP);
+	free(heap);
+	return 0;
+}
+
+int realtime_init(int priority, int cpu) {
+	struct sched_param param = { .sched_priority = priority };
+	cpu_set_t cpus;
+	int ret;
+
+	if (-1 == mlockall(MCL_CURRENT | MCL_FUTURE))
+		return -errno;
+
+	prefault_stack();
+	ret = prefault_heap();
+	if (ret)
+		return ret;
+
+	if (cpu >= 0) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (-1 == sched_setaffinity(0, sizeof(cpus), &cpus))
+			return -errno;
+	}
+
+	if (priority && -1 == sched_setscheduler(0, SCHED_FIFO, &param))
+		return -errno;
+
+	return 0;
+}
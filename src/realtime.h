@@ -0,0 +1,14 @@
+#ifndef __W2G_REALTIME_H
+#define __W2G_REALTIME_H
+
+/*
+ * Prepare the calling thread for low-latency event handling: lock all of
+ * the process's memory, pre-fault the stack and heap so the event loop never
+ * page faults, pin the thread to cpu unless cpu is negative, and schedule it
+ * with SCHED_FIFO at the given priority unless priority is 0. Threads started
+ * earlier keep their affinity and policy. Returns 0 on success or a negative
+ * error code.
+ */
+int realtime_init(int priority, int cpu);
+
+#endif // __W2G_REALTIME_H
@@ -0,0 +1,52 @@
+#include "ring.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+int ring_init(struct event_ring *ring) {
+	ring->head = ring->tail = 0;
+	ring->head_cache = ring->tail_cache = 0;
+	ring->sleeping = 0;
+	ring->wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (-1 == ring->wake_fd)
+		return -errno;
+	return 0;
+}
+
+void ring_close(struct event_ring *ring) {
+	if (-1 != ring->wake_fd) {
+		close(ring->wake_fd);
+		ring->wake_fd = -1;
+	}
+}
+
+void ring_wake(struct event_ring *ring) {
+	uint64_t one = 1;
+
+	if (__atomic_exchange_n(&ring->sleeping, 0, __ATOMIC_ACQ_REL))
+		write(ring->wake_fd, &one, sizeof(one));
+}
+
+void ring_wait(struct event_ring *ring, int fd) {
+	struct pollfd fds[2] = {
+		{ .fd = ring->wake_fd, .events = POLLIN },
+		{ .fd = fd, .events = POLLIN }, // Ignored if -1
+	};
+	uint64_t count;
+
+	__atomic_store_n(&ring->sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (ring_peek(ring)) {
+		__atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+		return;
+	}
+	if (-1 == poll(fds, 2, -1) || !(fds[0].revents & POLLIN)) {
+		__atomic_store_n(&ring->sleeping, 0, __ATOMIC_RELAXED);
+		return;
+	}
+	// A stale wakeup only makes the caller look at the ring again
+	read(ring->wake_fd, &count, sizeof(count));
+}
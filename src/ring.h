@@ -0,0 +1,116 @@
+#ifndef __W2G_RING_H
+#define __W2G_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <xwiimote.h>
+
+/*
+ * Lock-free single-producer, single-consumer ring of Wiimote events, from
+ * the reader thread to the emitter thread. Each index is written by one side
+ * only and sits on its own cache line, next to that side's cached copy of
+ * the other index, so the sides only share a line when the cached copy runs
+ * out. The consumer sleeps on an eventfd when the ring is empty.
+ */
+
+#define RING_SIZE 1024 // Power of two
+#define CACHE_LINE 64
+
+struct device;
+struct keymaps;
+
+struct ring_event {
+	struct device *dev; // NULL to stop the consumer, or to install keymaps
+	struct xwii_event ev;
+	struct keymaps *keymaps; // Reloaded keymaps, which dev moves to
+	unsigned int ifaces; // XWII_EVENT_WATCH: interfaces opened
+	int64_t read_ns; // When the reader read the event
+};
+
+struct event_ring {
+	// Producer
+	_Alignas(CACHE_LINE) size_t tail;
+	size_t head_cache;
+
+	// Consumer
+	_Alignas(CACHE_LINE) size_t head;
+	size_t tail_cache;
+
+	_Alignas(CACHE_LINE) int sleeping; // Consumer is waiting on wake_fd
+	int wake_fd;
+
+	_Alignas(CACHE_LINE) struct ring_event events[RING_SIZE];
+};
+
+int ring_init(struct event_ring *ring);
+void ring_close(struct event_ring *ring);
+
+/*
+ * Wake the consumer, if it is still sleeping
+ */
+void ring_wake(struct event_ring *ring);
+
+/*
+ * Sleep until the ring isn't empty or fd, if not -1, is readable
+ */
+void ring_wait(struct event_ring *ring, int fd);
+
+/*
+ * Slot for the next event, or NULL if the ring is full. The event is only
+ * seen by the consumer once pushed.
+ */
+static inline struct ring_event *ring_reserve(struct event_ring *ring) {
+	if (ring->tail - ring->head_cache == RING_SIZE) {
+		ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (ring->tail - ring->head_cache == RING_SIZE)
+			return NULL;
+	}
+	return ring->events + (ring->tail & (RING_SIZE - 1));
+}
+
+static inline void ring_push(struct event_ring *ring) {
+	__atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+	// Pairs with the fence in ring_wait(), so either the consumer sees the
+	// event or the producer sees it sleeping
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&ring->sleeping, __ATOMIC_RELAXED))
+		ring_wake(ring);
+}
+
+/*
+ * Oldest event, or NULL if the ring is empty
+ */
+static inline struct ring_event *ring_peek(struct event_ring *ring) {
+	if (ring->head == ring->tail_cache) {
+		ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (ring->head == ring->tail_cache)
+			return NULL;
+	}
+	return ring->events + (ring->head & (RING_SIZE - 1));
+}
+
+/*
+ * Event after the oldest one, or NULL
+ */
+static inline struct ring_event *ring_peek_next(struct event_ring *ring) {
+	if (ring->head + 1 == ring->tail_cache) {
+		ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if (ring->head + 1 == ring->tail_cache)
+			return NULL;
+	}
+	return ring->events + ((ring->head + 1) & (RING_SIZE - 1));
+}
+
+static inline void ring_pop(struct event_ring *ring) {
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Events in the ring, as seen by the producer
+ */
+static inline size_t ring_depth(struct event_ring *ring) {
+	return ring->tail - __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+}
+
+#endif // __W2G_RING_H
@@ -0,0 +1,71 @@
+#include "sink.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "loop.h"
+
+int sink_open_file(struct sink *sink, const char *path) {
+	sink->type = SINK_FILE;
+	sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (-1 == sink->fd)
+		return -errno;
+	return 0;
+}
+
+int sink_open_memory(struct sink *sink) {
+	sink->type = SINK_MEMORY;
+	sink->fd = -1;
+	sink->written = 0;
+	sink->events = calloc(SINK_MEMORY_SIZE, sizeof(*sink->events));
+	if (!sink->events)
+		return -ENOMEM;
+	return 0;
+}
+
+void sink_close(struct sink *sink) {
+	if (-1 != sink->fd) {
+		close(sink->fd);
+		sink->fd = -1;
+	}
+	free(sink->events);
+	sink->events = NULL;
+}
+
+/*
+ * Copy a frame into the ring, in at most two pieces
+ */
+static void write_memory(struct sink *sink, const struct input_event *frame, size_t len) {
+	size_t start, first;
+
+	// Only the end of a frame larger than the ring would be kept
+	if (len > SINK_MEMORY_SIZE) {
+		sink->written += len - SINK_MEMORY_SIZE;
+		frame += len - SINK_MEMORY_SIZE;
+		len = SINK_MEMORY_SIZE;
+	}
+
+	start = sink->written & (SINK_MEMORY_SIZE - 1);
+	first = SINK_MEMORY_SIZE - start < len ? SINK_MEMORY_SIZE - start : len;
+	memcpy(sink->events + start, frame, first * sizeof(*frame));
+	memcpy(sink->events, frame + first, (len - first) * sizeof(*frame));
+	sink->written += len;
+}
+
+int sink_write(struct sink *sink, int fd, const struct input_event *frame, size_t len) {
+	switch (sink->type) {
+	case SINK_UINPUT:
+		return loop_write(fd, frame, len * sizeof(*frame));
+	case SINK_FILE:
+		return loop_write(sink->fd, frame, len * sizeof(*frame));
+	case SINK_MEMORY:
+		write_memory(sink, frame, len);
+		return 0;
+	case SINK_NULL:
+	default:
+		return 0;
+	}
+}
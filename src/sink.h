@@ -0,0 +1,51 @@
+#ifndef __W2G_SINK_H
+#define __W2G_SINK_H
+
+#include <stddef.h>
+
+#include <linux/input.h>
+
+/*
+ * Where translated frames are written. The translation code only fills in
+ * frames of input_events, so it runs the same whatever takes them: the
+ * devices' virtual gamepads, a file, a ring in memory or nothing.
+ */
+
+#define SINK_MEMORY_SIZE 4096 // Events kept by a memory sink, power of two
+
+enum sink_type {
+	SINK_UINPUT, // The virtual gamepad of the device writing
+	SINK_FILE,
+	SINK_MEMORY, // The last SINK_MEMORY_SIZE events, older ones are overwritten
+	SINK_NULL
+};
+
+struct sink {
+	enum sink_type type;
+	int fd; // File sink, -1 otherwise
+	struct input_event *events; // Memory sink
+	size_t written; // Events written to a memory sink
+};
+
+/*
+ * Truncate or create a file and write to it
+ */
+int sink_open_file(struct sink *sink, const char *path);
+int sink_open_memory(struct sink *sink);
+void sink_close(struct sink *sink);
+
+/*
+ * Write a frame. A uinput sink writes it to fd, the device's gamepad, and a
+ * file sink through the event loop. Returns 0 or a negative error code.
+ */
+int sink_write(struct sink *sink, int fd, const struct input_event *frame, size_t len);
+
+/*
+ * Event n of those written to a memory sink. Only the last SINK_MEMORY_SIZE
+ * are kept.
+ */
+static inline const struct input_event *sink_event(const struct sink *sink, size_t n) {
+	return sink->events + (n & (SINK_MEMORY_SIZE - 1));
+}
+
+#endif // __W2G_SINK_H
@@ -0,0 +1,151 @@
+#include "trace.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Number of bytes of the event union used by each event type
+ */
+static size_t payload_len(unsigned int type) {
+	const struct xwii_event *ev;
+
+	switch (type) {
+	case XWII_EVENT_WATCH:
+	case XWII_EVENT_GONE:
+		return 0;
+	case XWII_EVENT_KEY:
+	case XWII_EVENT_NUNCHUK_KEY:
+	case XWII_EVENT_CLASSIC_CONTROLLER_KEY:
+	case XWII_EVENT_PRO_CONTROLLER_KEY:
+	case XWII_EVENT_GUITAR_KEY:
+	case XWII_EVENT_DRUMS_KEY:
+		return sizeof(ev->v.key);
+	case XWII_EVENT_ACCEL:
+	case XWII_EVENT_MOTION_PLUS:
+		return sizeof(ev->v.abs[0]);
+	case XWII_EVENT_NUNCHUK_MOVE:
+	case XWII_EVENT_PRO_CONTROLLER_MOVE:
+		return 2 * sizeof(ev->v.abs[0]);
+	case XWII_EVENT_CLASSIC_CONTROLLER_MOVE:
+	case XWII_EVENT_GUITAR_MOVE:
+		return 3 * sizeof(ev->v.abs[0]);
+	case XWII_EVENT_IR:
+	case XWII_EVENT_BALANCE_BOARD:
+		return 4 * sizeof(ev->v.abs[0]);
+	default:
+		return sizeof(ev->v);
+	}
+}
+
+// Writing
+
+FILE *trace_create(const char *path, unsigned int ifaces) {
+	struct trace_header header = {
+		.magic = TRACE_MAGIC,
+		.version = TRACE_VERSION,
+		.record_size = sizeof(struct trace_record),
+		.ifaces = ifaces,
+	};
+	FILE *file = fopen(path, "wb");
+
+	if (!file)
+		return NULL;
+	if (1 != fwrite(&header, sizeof(header), 1, file)) {
+		fclose(file);
+		return NULL;
+	}
+	return file;
+}
+
+int trace_write(FILE *file, const struct xwii_event *ev, unsigned int ifaces) {
+	struct trace_record rec = {
+		.usec = (int64_t) ev->time.tv_sec * 1000000 + ev->time.tv_usec,
+		.type = ev->type,
+		.len = payload_len(ev->type),
+		.ifaces = ifaces,
+	};
+
+	if (1 != fwrite(&rec, sizeof(rec), 1, file))
+		return -errno;
+	if (rec.len && 1 != fwrite(&ev->v, rec.len, 1, file))
+		return -errno;
+	return 0;
+}
+
+// Reading
+
+int trace_open(struct trace *trace, const char *path) {
+	const struct trace_header *header;
+	struct stat statbuf;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (-1 == fd)
+		return -errno;
+	if (-1 == fstat(fd, &statbuf)) {
+		close(fd);
+		return -errno;
+	}
+	if (statbuf.st_size < sizeof(*header)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	data = mmap(NULL, statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (MAP_FAILED == data)
+		return -errno;
+
+	header = data;
+	if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic))
+			|| TRACE_VERSION != header->version
+			|| sizeof(struct trace_record) != header->record_size) {
+		munmap(data, statbuf.st_size);
+		return -EINVAL;
+	}
+
+	trace->data = data;
+	trace->len = statbuf.st_size;
+	trace->pos = sizeof(*header);
+	trace->ifaces = header->ifaces;
+	return 0;
+}
+
+/*
+ * Read the next event. Returns 1 if an event was read, 0 at the end of the
+ * trace or -EINVAL if the trace is truncated.
+ */
+int trace_next(struct trace *trace, struct xwii_event *ev, unsigned int *ifaces) {
+	struct trace_record rec;
+
+	if (trace->pos == trace->len)
+		return 0;
+	if (trace->len - trace->pos < sizeof(rec))
+		return -EINVAL;
+	memcpy(&rec, trace->data + trace->pos, sizeof(rec));
+	trace->pos += sizeof(rec);
+
+	if (rec.len > sizeof(ev->v) || trace->len - trace->pos < rec.len)
+		return -EINVAL;
+
+	ev->time.tv_sec = rec.usec / 1000000;
+	ev->time.tv_usec = rec.usec % 1000000;
+	ev->type = rec.type;
+	memcpy(&ev->v, trace->data + trace->pos, rec.len);
+	trace->pos += rec.len;
+
+	*ifaces = rec.ifaces;
+	return 1;
+}
+
+void trace_close(struct trace *trace) {
+	if (trace->data) {
+		munmap((void *) trace->data, trace->len);
+		trace->data = NULL;
+	}
+}
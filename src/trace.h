@@ -0,0 +1,50 @@
+#ifndef __W2G_TRACE_H
+#define __W2G_TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <xwiimote.h>
+
+/*
+ * Binary trace of xwiimote events.
+ *
+ * A trace is a trace_header followed by records. Each record is a
+ * trace_record followed by `len` bytes of the event union; only the part
+ * of the union used by the event type is stored.
+ */
+
+#define TRACE_MAGIC "W2GT"
+#define TRACE_VERSION 1
+
+struct trace_header {
+	char magic[4];
+	uint16_t version;
+	uint16_t record_size; // sizeof(struct trace_record)
+	uint32_t ifaces; // Interfaces open when recording started
+	uint32_t reserved;
+};
+
+struct trace_record {
+	int64_t usec; // ev.time in microseconds
+	uint16_t type;
+	uint16_t len;
+	uint32_t ifaces; // XWII_EVENT_WATCH: interfaces opened after the change
+};
+
+struct trace {
+	const char *data;
+	size_t len;
+	size_t pos;
+	uint32_t ifaces;
+};
+
+FILE *trace_create(const char *path, unsigned int ifaces);
+int trace_write(FILE *file, const struct xwii_event *ev, unsigned int ifaces);
+
+int trace_open(struct trace *trace, const char *path);
+int trace_next(struct trace *trace, struct xwii_event *ev, unsigned int *ifaces);
+void trace_close(struct trace *trace);
+
+#endif // __W2G_TRACE_H
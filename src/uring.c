@@ -0,0 +1,415 @@
+#include "uring.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#define RING_ENTRIES 64
+#define WRITE_BUF_SIZE (16 * 1024) // Per chain
+#define MAX_CHAIN 32 // Writes per chain
+
+/*
+ * Request kinds, in the top bits of user_data. Polls carry the index of their
+ * slot in the low 32 bits and its generation above, and writes carry their
+ * length.
+ */
+#define TAG_SHIFT 62
+#define TAG_POLL 0ULL
+#define TAG_WRITE 1ULL
+#define TAG_CHAIN_END 2ULL // Last write of a chain
+#define TAG_REMOVE 3ULL
+#define GEN_MASK 0x3fffffffU
+
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+static struct {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	unsigned int sq_entries;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+} ring = { .fd = -1 };
+
+/*
+ * A registered source. The generation changes whenever the slot is reused, so
+ * completions of a removed source's poll are recognized and dropped.
+ */
+struct slot {
+	struct source *source;
+	uint32_t gen;
+};
+static struct slot *slots;
+static unsigned int num_slots;
+
+// Completed polls of the current wakeup, as their user_data. Dispatched
+// sources are only re-armed once every ready one was dispatched, so each
+// registered source appears at most once, even if a write waits for its
+// chain, and so reaps, during a dispatch.
+static uint64_t *ready;
+static unsigned int num_ready;
+
+/*
+ * Writes are gathered in one buffer while the chain from the other is in
+ * flight. A new chain is only submitted once the last one completed, since
+ * writes to devices without nonblocking support run on kernel workers, and
+ * only the writes within a chain are ordered.
+ */
+struct pending_write {
+	int fd;
+	size_t offset;
+	size_t len;
+};
+static char write_bufs[2][WRITE_BUF_SIZE];
+static int collect; // Buffer gathering writes
+static size_t collect_len;
+static struct pending_write pending[MAX_CHAIN];
+static int num_pending;
+static int chain_inflight;
+static int write_error;
+
+static int enter(unsigned int min_complete, const sigset_t *sigmask) {
+	unsigned int to_submit = *ring.sq_tail - load_acquire(ring.sq_head);
+	int ret;
+
+	__atomic_add_fetch(&loop_syscalls, 1, __ATOMIC_RELAXED);
+	ret = syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+			min_complete ? IORING_ENTER_GETEVENTS : 0, sigmask, _NSIG / 8);
+	return -1 == ret ? -errno : 0;
+}
+
+/*
+ * Get the next free SQE, submitting the queued ones if the ring is full
+ */
+static struct io_uring_sqe *get_sqe() {
+	unsigned int tail = *ring.sq_tail;
+	unsigned int index;
+	struct io_uring_sqe *sqe;
+
+	while (tail - load_acquire(ring.sq_head) == ring.sq_entries)
+		enter(0, NULL);
+
+	index = tail & *ring.sq_mask;
+	sqe = ring.sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[index] = index;
+	return sqe;
+}
+
+static inline void push_sqe() {
+	store_release(ring.sq_tail, *ring.sq_tail + 1);
+}
+
+static void arm_poll(unsigned int id) {
+	struct io_uring_sqe *sqe = get_sqe();
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = slots[id].source->fd;
+	sqe->poll32_events = POLLIN;
+	sqe->user_data = (uint64_t) slots[id].gen << 32 | id;
+	push_sqe();
+}
+
+static void complete(const struct io_uring_cqe *cqe) {
+	uint64_t tag = cqe->user_data >> TAG_SHIFT;
+	uint32_t low = cqe->user_data; // Slot or length
+	const struct slot *slot;
+
+	switch (tag) {
+	case TAG_POLL:
+		slot = slots + low;
+		if (slot->source && slot->gen == cqe->user_data >> 32) {
+			assert(num_ready < 2 * num_slots);
+			ready[num_ready++] = cqe->user_data;
+		}
+		break;
+	case TAG_WRITE:
+	case TAG_CHAIN_END:
+		// The rest of a chain is canceled after the first failure
+		if (!write_error && -ECANCELED != cqe->res)
+			write_error = cqe->res < 0 ? cqe->res : (uint32_t) cqe->res != low ? -EIO : 0;
+		if (TAG_CHAIN_END == tag)
+			chain_inflight = false;
+		break;
+	case TAG_REMOVE:
+	default:
+		break;
+	}
+}
+
+static void reap() {
+	unsigned int head = *ring.cq_head;
+	unsigned int tail = load_acquire(ring.cq_tail);
+
+	for (; head != tail; ++head)
+		complete(ring.cqes + (head & *ring.cq_mask));
+	store_release(ring.cq_head, head);
+}
+
+/*
+ * Queue the gathered writes as one chain, unless a chain is in flight
+ */
+static void queue_chain() {
+	struct io_uring_sqe *sqe;
+	const struct pending_write *w;
+	int i;
+
+	if (chain_inflight || !num_pending)
+		return;
+
+	// The chain must not be split by a submission
+	if (ring.sq_entries - (*ring.sq_tail - load_acquire(ring.sq_head)) < num_pending)
+		enter(0, NULL);
+
+	for (i = 0; i < num_pending; ++i) {
+		w = pending + i;
+		sqe = get_sqe();
+		sqe->opcode = IORING_OP_WRITE;
+		sqe->fd = w->fd;
+		sqe->addr = (uintptr_t) (write_bufs[collect] + w->offset);
+		sqe->len = w->len;
+		sqe->off = -1; // At the file position, for file output
+		if (i < num_pending - 1) {
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = TAG_WRITE << TAG_SHIFT | w->len;
+		} else {
+			sqe->user_data = TAG_CHAIN_END << TAG_SHIFT | w->len;
+		}
+		push_sqe();
+	}
+
+	chain_inflight = true;
+	collect = !collect;
+	collect_len = 0;
+	num_pending = 0;
+}
+
+/*
+ * Wait until the chain in flight completed
+ */
+static int wait_chain() {
+	int ret;
+
+	while (chain_inflight) {
+		ret = enter(1, NULL);
+		if (ret && -EINTR != ret)
+			return ret;
+		reap();
+	}
+	return 0;
+}
+
+int uring_init() {
+	struct io_uring_params params;
+	int ret;
+
+	memset(&params, 0, sizeof(params));
+	ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (-1 == ring.fd)
+		return -errno;
+
+	// Writes at the current position, with an offset of -1, need 5.6, which
+	// also maps both rings at once
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+			|| !(params.features & IORING_FEAT_RW_CUR_POS)) {
+		ret = -ENOSYS;
+		goto fail;
+	}
+
+	ring.sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	ring.cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (ring.cq_ring_size > ring.sq_ring_size)
+		ring.sq_ring_size = ring.cq_ring_size;
+	ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring.sq_ring) {
+		ret = -errno;
+		goto fail;
+	}
+	ring.cq_ring = ring.sq_ring;
+
+	ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+			PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (MAP_FAILED == ring.sqes) {
+		ret = -errno;
+		munmap(ring.sq_ring, ring.sq_ring_size);
+		goto fail;
+	}
+
+	ring.sq_head = (unsigned int *) ((char *) ring.sq_ring + params.sq_off.head);
+	ring.sq_tail = (unsigned int *) ((char *) ring.sq_ring + params.sq_off.tail);
+	ring.sq_mask = (unsigned int *) ((char *) ring.sq_ring + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned int *) ((char *) ring.sq_ring + params.sq_off.array);
+	ring.cq_head = (unsigned int *) ((char *) ring.cq_ring + params.cq_off.head);
+	ring.cq_tail = (unsigned int *) ((char *) ring.cq_ring + params.cq_off.tail);
+	ring.cq_mask = (unsigned int *) ((char *) ring.cq_ring + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *) ((char *) ring.cq_ring + params.cq_off.cqes);
+	ring.sq_entries = params.sq_entries;
+	return 0;
+
+fail:
+	close(ring.fd);
+	ring.fd = -1;
+	return ret;
+}
+
+void uring_close() {
+	if (-1 == ring.fd)
+		return;
+	uring_flush();
+	munmap(ring.sqes, ring.sq_entries * sizeof(struct io_uring_sqe));
+	munmap(ring.sq_ring, ring.sq_ring_size);
+	close(ring.fd);
+	ring.fd = -1;
+	free(slots);
+	free(ready);
+	slots = NULL;
+	ready = NULL;
+	num_slots = 0;
+}
+
+int uring_add(struct source *source) {
+	struct slot *new_slots;
+	uint64_t *new_ready;
+	unsigned int id, n;
+
+	for (id = 0; id < num_slots && slots[id].source; ++id);
+	if (id == num_slots) {
+		n = num_slots ? 2 * num_slots : 8;
+		new_slots = realloc(slots, n * sizeof(*slots));
+		if (!new_slots)
+			return -ENOMEM;
+		slots = new_slots;
+		memset(slots + num_slots, 0, (n - num_slots) * sizeof(*slots));
+		// A removed source's poll may complete after its slot is reused
+		new_ready = realloc(ready, 2 * n * sizeof(*ready));
+		if (!new_ready)
+			return -ENOMEM;
+		ready = new_ready;
+		num_slots = n;
+	}
+
+	slots[id].source = source;
+	slots[id].gen = (slots[id].gen + 1) & GEN_MASK;
+	source->id = id;
+	arm_poll(id);
+	return 0;
+}
+
+void uring_remove(struct source *source) {
+	struct slot *slot = slots + source->id;
+	struct io_uring_sqe *sqe;
+
+	if (-1 == ring.fd || slot->source != source)
+		return;
+
+	// Fails harmlessly if the poll already completed
+	sqe = get_sqe();
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->addr = (uint64_t) slot->gen << 32 | source->id;
+	sqe->user_data = TAG_REMOVE << TAG_SHIFT;
+	push_sqe();
+
+	slot->source = NULL;
+}
+
+int uring_wait(const sigset_t *sigmask) {
+	struct source *source;
+	struct slot *slot;
+	uint64_t user_data;
+	unsigned int i, id;
+	int dispatched = 0;
+	int ret;
+
+	// Completed writes wake the wait too
+	while (!dispatched) {
+		queue_chain();
+		ret = enter(1, sigmask);
+		if (ret)
+			return ret;
+		reap();
+
+		for (i = 0; i < num_ready; ++i) {
+			user_data = ready[i];
+			id = (uint32_t) user_data;
+			slot = slots + id;
+			source = slot->source;
+			// The source may be removed while other sources are being
+			// dispatched
+			if (!source || slot->gen != user_data >> 32)
+				continue;
+			source->dispatch(source);
+			++dispatched;
+		}
+
+		// Sources removed, or removed and replaced, by a dispatch aren't
+		// re-armed. A generation never returns, so the same check skips
+		// those which weren't dispatched.
+		for (i = 0; i < num_ready; ++i) {
+			user_data = ready[i];
+			id = (uint32_t) user_data;
+			if (slots[id].source && slots[id].gen == user_data >> 32)
+				arm_poll(id);
+		}
+		num_ready = 0;
+
+		if (write_error) {
+			ret = write_error;
+			write_error = 0;
+			return ret;
+		}
+	}
+	return dispatched;
+}
+
+int uring_write(int fd, const void *buf, size_t len) {
+	struct pending_write *w;
+	int ret;
+
+	if (len > WRITE_BUF_SIZE)
+		return -EMSGSIZE;
+
+	if (MAX_CHAIN == num_pending || collect_len + len > WRITE_BUF_SIZE) {
+		ret = wait_chain();
+		if (ret)
+			return ret;
+		queue_chain();
+	}
+
+	w = pending + num_pending++;
+	w->fd = fd;
+	w->offset = collect_len;
+	w->len = len;
+	memcpy(write_bufs[collect] + collect_len, buf, len);
+	collect_len += len;
+	return 0;
+}
+
+int uring_flush() {
+	int ret;
+
+	if (-1 == ring.fd)
+		return 0;
+
+	ret = wait_chain();
+	if (!ret) {
+		queue_chain();
+		ret = wait_chain();
+	}
+	if (!ret && write_error)
+		ret = write_error;
+	write_error = 0;
+	return ret;
+}
@@ -0,0 +1,30 @@
+#ifndef __W2G_URING_H
+#define __W2G_URING_H
+
+#include <signal.h>
+#include <stddef.h>
+
+#include "loop.h"
+
+/*
+ * io_uring backend of the event loop, used through loop.h. Sources are
+ * waited on with one-shot poll requests, and writes are queued and submitted
+ * as a chain of linked requests by the next wait, so a busy wakeup costs a
+ * single io_uring_enter(). A wakeup which fills a chain while the previous
+ * one is in flight waits for it from the write.
+ */
+
+/*
+ * Returns -ENOSYS or another negative error code if io_uring is unavailable
+ */
+int uring_init();
+void uring_close();
+
+int uring_add(struct source *source);
+void uring_remove(struct source *source);
+int uring_wait(const sigset_t *sigmask);
+
+int uring_write(int fd, const void *buf, size_t len);
+int uring_flush();
+
+#endif // __W2G_URING_H
@@ -3,6 +3,7 @@
 #include <stdbool.h>
 
 #include <string.h>
+#include <time.h>
 
 inline int strmatch(const char *c1, const char *c2, size_t len) {
 	if (strlen(c1) == len) {
@@ -10,3 +11,9 @@ inline int strmatch(const char *c1, const char *c2, size_t len) {
 	}
 	return false;
 }
+
+int64_t time_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
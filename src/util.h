@@ -2,10 +2,19 @@
 #define __W2G_UTIL_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#define container_of(ptr, type, member) \
+	((type *) ((char *) (ptr) - offsetof(type, member)))
 
 /*
  * c2 has `len` non-null characters
  */
 int strmatch(const char *c1, const char *c2, size_t len);
 
-#endif // __W2G_UTIL_H
\ No newline at end of file
+/*
+ * Current CLOCK_MONOTONIC time in nanoseconds
+ */
+int64_t time_ns();
+
+#endif // __W2G_UTIL_H
@@ -0,0 +1,141 @@
+#include "wheel.h"
+
+#include <string.h>
+
+#define LEVEL_SHIFT(level) (WHEEL_BITS + ((level) - 1) * WHEEL_LEVEL_BITS)
+#define LEVEL_MASK ((1 << WHEEL_LEVEL_BITS) - 1)
+
+void wheel_init(struct wheel *wheel, uint64_t now) {
+	memset(wheel, 0, sizeof(*wheel));
+	wheel->now = now;
+}
+
+static void link_timer(struct wheel *wheel, struct timer *timer, unsigned int level,
+		unsigned int index) {
+	struct timer **head = &wheel->slots[level][index];
+
+	timer->slot = level * WHEEL_SLOTS + index;
+	timer->next = *head;
+	if (*head)
+		(*head)->pprev = &timer->next;
+	timer->pprev = head;
+	*head = timer;
+
+	if (level)
+		++wheel->coarse;
+	else
+		wheel->pending[index / 64] |= 1ull << index % 64;
+}
+
+/*
+ * Link a timer into the slot for its expiry, which may be the current tick
+ * while cascading
+ */
+static void place_timer(struct wheel *wheel, struct timer *timer) {
+	uint64_t expires = timer->expires;
+	unsigned int level;
+
+	if (expires - wheel->now < WHEEL_SLOTS) {
+		link_timer(wheel, timer, 0, expires & (WHEEL_SLOTS - 1));
+		return;
+	}
+	// The first level whose slot isn't the current one, so the slot is
+	// spread out before the timer is due
+	for (level = 1; level < WHEEL_LEVELS - 1; ++level) {
+		if ((expires >> LEVEL_SHIFT(level)) - (wheel->now >> LEVEL_SHIFT(level)) <= LEVEL_MASK)
+			break;
+	}
+	link_timer(wheel, timer, level, (expires >> LEVEL_SHIFT(level)) & LEVEL_MASK);
+}
+
+void wheel_add(struct wheel *wheel, struct timer *timer, uint64_t expires) {
+	if (expires <= wheel->now)
+		expires = wheel->now + 1;
+	if (expires - wheel->now >= WHEEL_MAX_TICKS)
+		expires = wheel->now + WHEEL_MAX_TICKS - 1;
+	timer->expires = expires;
+	place_timer(wheel, timer);
+}
+
+void wheel_del(struct wheel *wheel, struct timer *timer) {
+	unsigned int level = timer->slot / WHEEL_SLOTS;
+	unsigned int index = timer->slot % WHEEL_SLOTS;
+
+	if (!timer->pprev)
+		return;
+	*timer->pprev = timer->next;
+	if (timer->next)
+		timer->next->pprev = timer->pprev;
+	timer->pprev = NULL;
+
+	if (level)
+		--wheel->coarse;
+	else if (!wheel->slots[0][index])
+		wheel->pending[index / 64] &= ~(1ull << index % 64);
+}
+
+/*
+ * Spread the timers of a coarse slot over the finer levels
+ */
+static void cascade(struct wheel *wheel, unsigned int level) {
+	unsigned int index = (wheel->now >> LEVEL_SHIFT(level)) & LEVEL_MASK;
+	struct timer *timer;
+
+	while ((timer = wheel->slots[level][index])) {
+		wheel_del(wheel, timer);
+		place_timer(wheel, timer);
+	}
+}
+
+void wheel_advance(struct wheel *wheel, uint64_t now) {
+	struct timer *timer;
+	unsigned int index, level;
+	uint64_t next;
+
+	while (wheel->now < now) {
+		// Skip ticks with nothing to do
+		next = wheel_next(wheel);
+		if (next > now) {
+			wheel->now = now;
+			return;
+		}
+		wheel->now = next;
+
+		for (level = WHEEL_LEVELS - 1; level > 0; --level) {
+			if (!(wheel->now & ((1ull << LEVEL_SHIFT(level)) - 1)))
+				cascade(wheel, level);
+		}
+
+		index = wheel->now & (WHEEL_SLOTS - 1);
+		while ((timer = wheel->slots[0][index])) {
+			wheel_del(wheel, timer);
+			timer->fire(timer);
+		}
+	}
+}
+
+uint64_t wheel_next(const struct wheel *wheel) {
+	unsigned int i, index, bit;
+	uint64_t bits, next = UINT64_MAX;
+
+	// The first level holds the next WHEEL_SLOTS - 1 ticks after the current
+	// one. Scan its bitmap a word at a time.
+	for (i = 1; i < WHEEL_SLOTS; i += 64 - bit) {
+		index = (wheel->now + i) & (WHEEL_SLOTS - 1);
+		bit = index % 64;
+		bits = wheel->pending[index / 64] >> bit;
+		if (bits) {
+			if (i + __builtin_ctzll(bits) < WHEEL_SLOTS)
+				next = wheel->now + i + __builtin_ctzll(bits);
+			break;
+		}
+	}
+
+	if (wheel->coarse) {
+		// The next tick the coarse levels are cascaded on
+		bits = ((wheel->now >> WHEEL_BITS) + 1) << WHEEL_BITS;
+		if (bits < next)
+			next = bits;
+	}
+	return next;
+}
@@ -0,0 +1,61 @@
+#ifndef __W2G_WHEEL_H
+#define __W2G_WHEEL_H
+
+#include <stdint.h>
+
+/*
+ * Hierarchical timer wheel. Time is counted in ticks. Timers due within
+ * WHEEL_SLOTS ticks sit in the first level, one slot per tick, and later
+ * ones in coarser levels, whose slots are spread over the finer levels as
+ * their time comes. Adding, removing and firing a timer take constant time,
+ * and a bitmap of the first level finds the next due tick, so the wheel only
+ * needs waking when a timer is due.
+ */
+
+#define WHEEL_BITS 8 // First level slots, as a power of two
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVEL_BITS 6 // Slots of the coarser levels, as a power of two
+#define WHEEL_LEVELS 3
+#define WHEEL_MAX_TICKS (1ull << (WHEEL_BITS + (WHEEL_LEVELS - 1) * WHEEL_LEVEL_BITS))
+
+struct timer {
+	struct timer *next, **pprev; // pprev is NULL when not pending
+	uint64_t expires; // Tick
+	unsigned int slot; // Level * WHEEL_SLOTS + index
+	void (*fire)(struct timer *timer);
+};
+
+struct wheel {
+	uint64_t now; // Last tick handled
+	struct timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	uint64_t pending[WHEEL_SLOTS / 64]; // First level slots holding timers
+	unsigned int coarse; // Timers in the coarser levels
+};
+
+void wheel_init(struct wheel *wheel, uint64_t now);
+
+/*
+ * Schedule a timer, which must not be pending. Timers due before the next
+ * tick fire on it, and ones beyond WHEEL_MAX_TICKS fire early.
+ */
+void wheel_add(struct wheel *wheel, struct timer *timer, uint64_t expires);
+
+void wheel_del(struct wheel *wheel, struct timer *timer);
+
+static inline int timer_pending(const struct timer *timer) {
+	return !!timer->pprev;
+}
+
+/*
+ * Fire every timer due up to and including tick now. Timers may be added
+ * and removed from fire().
+ */
+void wheel_advance(struct wheel *wheel, uint64_t now);
+
+/*
+ * Tick at which the wheel next needs advancing, or UINT64_MAX if no timer is
+ * pending
+ */
+uint64_t wheel_next(const struct wheel *wheel);
+
+#endif // __W2G_WHEEL_H
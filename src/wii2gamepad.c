@@ -4,54 +4,238 @@
 
 #include <assert.h>
 #include <errno.h>
-#include <poll.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <libevdev/libevdev.h>
 #include <libevdev/libevdev-uinput.h>
 #include <xwiimote.h>
 
+#include "axis.h"
+#include "bench.h"
+#include "cache.h"
 #include "config.h"
+#include "device.h"
+#include "histogram.h"
+#include "loop.h"
+#include "motion.h"
+#include "pointer.h"
+#include "realtime.h"
+#include "ring.h"
+#include "sink.h"
+#include "trace.h"
+#include "util.h"
 
-#define ABSMAX 98
 #define SUPPORTED_IFACES (XWII_IFACE_CORE | XWII_IFACE_NUNCHUK | XWII_IFACE_CLASSIC_CONTROLLER)
+#define ACCEL_AXES (1u << AXIS_ACCEL_X | 1u << AXIS_ACCEL_Y | 1u << AXIS_ACCEL_Z \
+		| 1u << AXIS_ACCEL_ROLL | 1u << AXIS_ACCEL_PITCH)
+#define IR_AXES (1u << AXIS_IR_X | 1u << AXIS_IR_Y | 1u << AXIS_IR_ROLL)
+#define MP_AXES (1u << AXIS_MP_ROLL | 1u << AXIS_MP_PITCH | 1u << AXIS_MP_YAW)
 #define DEFAULT_KEYMAP_PATH "default.cfg"
+#define REOPEN_DELAY_MS 50 // Before the first retry, doubled for each retry
+#define REOPEN_MAX_DELAY_MS 800
+#define REPLAY_BATCH 16 // Events sent through the event loop at once
+#define BENCH_EVENTS 100000 // Synthetic key and analog events for each keymap
+#define BENCH_SWITCHES 10000 // Synthetic extension switches for each keymap
+#define TIMER_TICK_NS 1000000 // Resolution of turbo and macros
+#define RELOAD_BUF_SIZE 4096 // inotify events read at once
 
-int max_retries = 3;
+int max_retries = 8;
+int batch_dispatch = false;
+int hotplug = false;
+int persistent = false; // One uinput device for every extension
+int threaded = false; // Translate and write on the emitter thread
+// SUPPORTED_IFACES, and the sensors needed by mapped axes
+static unsigned int wanted_ifaces = SUPPORTED_IFACES;
 
-struct xwii_iface *iface;
+// Shared by all devices, and only used by the thread translating events
+static struct keymaps *keymaps;
+static struct keymaps *retired_keymaps; // Replaced by the last reload
 
-struct map_data keymap_core[XWII_KEY_NUM],
-	keymap_nunchuk[XWII_KEY_NUM],
-	keymap_classic[XWII_KEY_NUM];
-struct map_data *keymap;
-struct controller_data controller_core,
-	controller_nunchuk,
-	controller_classic;
-struct controller_data *controller_data;
+struct device *devices;
+static int next_num = 1; // Number given to hotplugged Wiimotes
 
-struct libevdev_uinput *uinput_dev;
+// Hotplug monitor
+static struct xwii_monitor *monitor;
+static struct source monitor_source;
+
+static volatile sig_atomic_t terminate;
+static volatile sig_atomic_t dump_latency;
+
+// Where translated events are written. Replay writes to a file or nowhere,
+// and the translation benchmark to memory.
+static struct sink output = { .type = SINK_UINPUT, .fd = -1 };
+
+FILE *trace_file; // Recording destination
+
+// Loop statistics, used to compare batched and unbatched dispatch
+static struct {
+	unsigned long events; // Events returned by xwii_iface_dispatch()
+	unsigned long reports; // Events which produced uinput output
+	unsigned long polls; // loop_wait() calls
+	unsigned long dispatches;
+	unsigned long writes; // Not including SYN_REPORT
+	unsigned long syncs;
+	unsigned long flushes; // Frames written to the output
+} stats;
+
+// Time from the kernel timestamp of a Wiimote event to the write of the
+// frame holding its output, in microseconds
+int measure_latency = false;
+static struct histogram latency[XWII_EVENT_NUM];
+// From the first event of a wakeup to the start of its dispatch
+static struct histogram wakeup_latency;
+
+// Threaded mode. The main thread reads events and queues them for the emitter
+// thread, which translates and writes them, so a stalled output doesn't delay
+// reading.
+static struct event_ring ring = { .wake_fd = -1 };
+static pthread_t emitter;
+static int emitter_running;
+static struct {
+	unsigned long overflows; // Events dropped because the ring was full
+	struct histogram depth; // Events in the ring as each one is queued
+	struct histogram queued; // From read to translation, in microseconds
+} pipeline;
+
+// Turbo and macro timers, on a wheel advanced by a single timerfd armed for
+// the next due tick. Any number of timers costs one wakeup per tick. In
+// threaded mode the wheel belongs to the emitter.
+static struct wheel wheel;
+static struct source timer_source = { .fd = -1 };
+static int64_t timer_epoch_ns; // Time of tick 0, the epoch of the trace when replaying
+static uint64_t timer_armed = UINT64_MAX; // Tick the timerfd is set for
+static int64_t timer_now_ns; // Time of the current wakeup
+static int64_t replay_clock_ns = -1; // Trace time while replaying
+static struct device *timer_synced; // Devices written to by timers
+static struct {
+	unsigned long wakeups;
+	unsigned long fired;
+	unsigned long syncs; // Frames written by timers
+	struct histogram late; // From the due time to the wakeup, in microseconds
+} timer_stats;
+
+// Reloading the keymap when its file changes. The file's directory is
+// watched, since editors often replace the file instead of writing to it.
+static const char *keymap_path;
+static const char *keymap_name; // Within its directory
+static struct source reload_source = { .fd = -1 };
+
+static const char *const event_names[XWII_EVENT_NUM] = {
+	[XWII_EVENT_KEY] = "Key",
+	[XWII_EVENT_ACCEL] = "Accelerometer",
+	[XWII_EVENT_IR] = "IR",
+	[XWII_EVENT_MOTION_PLUS] = "MotionPlus",
+	[XWII_EVENT_WATCH] = "Watch",
+	[XWII_EVENT_CLASSIC_CONTROLLER_KEY] = "Classic key",
+	[XWII_EVENT_CLASSIC_CONTROLLER_MOVE] = "Classic move",
+	[XWII_EVENT_NUNCHUK_KEY] = "Nunchuk key",
+	[XWII_EVENT_NUNCHUK_MOVE] = "Nunchuk move",
+};
 
 // Cleanup
 
-static inline void cleanup_evdev() {
-	if (uinput_dev) {
-		libevdev_uinput_destroy(uinput_dev);
-		uinput_dev = NULL;
+static inline void cleanup_evdev(struct device *dev) {
+	if (dev->uinput_dev) {
+		// Frames queued by io_uring must not reach the next file with
+		// this number
+		loop_flush();
+		libevdev_uinput_destroy(dev->uinput_dev);
+		dev->uinput_dev = NULL;
 	}
 }
-static inline void cleanup_wiimote() {
-	if (iface) {
+static inline void cleanup_wiimote(struct device *dev) {
+	if (dev->iface) {
 		// Close necessary interfaces
-		xwii_iface_close(iface, xwii_iface_opened(iface));
-		xwii_iface_unref(iface);
+		xwii_iface_close(dev->iface, xwii_iface_opened(dev->iface));
+		xwii_iface_unref(dev->iface);
+		dev->iface = NULL;
+	}
+}
+/*
+ * Take a device out of the device list and the event loop, and close its
+ * Wiimote
+ */
+static void unlink_device(struct device *dev) {
+	struct device **p;
+
+	for (p = &devices; *p != dev; p = &(*p)->next);
+	*p = dev->next;
+
+	if (dev->source.dispatch)
+		loop_remove(&dev->source);
+	if (dev->reopen_source.dispatch) {
+		loop_remove(&dev->reopen_source);
+		close(dev->reopen_source.fd);
+	}
+	cleanup_wiimote(dev);
+}
+static void cancel_key_timers(struct device *dev, int release);
+static inline void free_device(struct device *dev) {
+	// The wheel must not fire for a freed device
+	cancel_key_timers(dev, false);
+	cleanup_evdev(dev);
+	free(dev->path);
+	free(dev);
+}
+static void remove_device(struct device *dev) {
+	unlink_device(dev);
+	free_device(dev);
+}
+static inline void cleanup_trace() {
+	if (trace_file) {
+		fclose(trace_file);
+		trace_file = NULL;
+	}
+}
+static inline void cleanup_monitor() {
+	if (monitor) {
+		loop_remove(&monitor_source);
+		xwii_monitor_unref(monitor);
+		monitor = NULL;
+	}
+}
+static inline void cleanup_timers() {
+	if (-1 != timer_source.fd) {
+		if (!threaded)
+			loop_remove(&timer_source);
+		close(timer_source.fd);
+		timer_source.fd = -1;
+	}
+}
+static inline void cleanup_reload() {
+	if (-1 != reload_source.fd) {
+		loop_remove(&reload_source);
+		close(reload_source.fd);
+		reload_source.fd = -1;
 	}
 }
+static void stop_emitter();
 static inline void cleanup() {
-	cleanup_wiimote();
-	cleanup_evdev();
+	// The emitter uses the devices
+	if (emitter_running && !pthread_equal(emitter, pthread_self()))
+		stop_emitter();
+	ring_close(&ring);
+	while (devices)
+		remove_device(devices);
+	cleanup_timers();
+	cleanup_reload();
+	cleanup_monitor();
+	cleanup_trace();
+	loop_close();
+	free_keymaps(keymaps);
+	free_keymaps(retired_keymaps);
+	keymaps = NULL;
+	retired_keymaps = NULL;
 }
 
 // Error handling
@@ -66,6 +250,10 @@ static inline void w2g_error(int err, const char *msg) {
 	cleanup();
 	exit(EXIT_FAILURE);
 }
+static inline void w2g_warn(int err, const char *msg) {
+	errno = err < 0 ? -err : err;
+	perror(msg);
+}
 static void w2g_fail(const char *msg, ...) {
 	va_list args;
 	va_start(args, msg);
@@ -77,7 +265,9 @@ static void w2g_fail(const char *msg, ...) {
 
 static void sighandler(int signal) {
 	if (signal == SIGINT) {
-		cleanup();
+		terminate = true;
+	} else if (signal == SIGUSR1) {
+		dump_latency = true;
 	}
 }
 
@@ -109,8 +299,8 @@ static char *get_dev(int num)
 	return ent;
 }
 
-static void init_keymap(const char *path) {
-	ssize_t ret = read_config(path);
+static void init_keymap(const char *path, int compile) {
+	ssize_t ret = compile ? compile_config(path, &keymaps) : read_config(path, &keymaps);
 	if (ret) {
 		if (ret < 0) {
 			w2g_error(ret, "Error reading keymap");
@@ -120,51 +310,235 @@ static void init_keymap(const char *path) {
 	}
 }
 
-static void init_evdev() {
-	struct libevdev *evdev;
-	struct input_absinfo absinfo;
-	int ret;
+/*
+ * Parse a keymap from standard input, as a fuzzer feeds it. The keymap is
+ * copied to a buffer of its exact size, so a sanitizer catches any read past
+ * its end.
+ */
+static void check_keymap() {
+	char *buf = NULL, *config;
+	size_t len = 0, size = 0;
+	ssize_t ret;
+
+	for (;;) {
+		if (len == size) {
+			size = size ? size * 2 : 4096;
+			buf = realloc(buf, size);
+			if (!buf)
+				w2g_error(ENOMEM, "Unable to read keymap");
+		}
+		ret = read(STDIN_FILENO, buf + len, size - len);
+		if (-1 == ret) {
+			if (EINTR == errno)
+				continue;
+			w2g_error(errno, "Unable to read keymap");
+		}
+		if (!ret)
+			break;
+		len += ret;
+	}
+
+	config = malloc(len ? len : 1);
+	if (!config)
+		w2g_error(ENOMEM, "Unable to read keymap");
+	memcpy(config, buf, len);
+	free(buf);
+
+	ret = parse_config_buffer(config, len, &keymaps);
+	free(config);
+	if (ret) {
+		if (ret < 0) {
+			w2g_error(ret, "Error reading keymap");
+		} else {
+			w2g_fail("Error reading keymap on line %d\n", ret);
+		}
+	}
+	free_keymaps(keymaps);
+	keymaps = NULL;
+}
+
+// Range of ABS_ outputs which don't set their own
+static const struct input_absinfo default_absinfo = {
+	.minimum = -ABSMAX,
+	.maximum = ABSMAX,
+	.fuzz = ABSFUZZ,
+	.flat = ABSFLAT,
+	.resolution = 1,
+};
+
+/*
+ * Ranges of the ABS_ codes of a gamepad. A persistent gamepad serves every
+ * keymap, so each of its codes spans the ranges the code has in all of them.
+ */
+struct abs_ranges {
+	struct input_absinfo info[ABS_CNT];
+	uint64_t used; // Bit n is set if code n is enabled
+};
+
+/*
+ * Widen the range of a code to include another
+ */
+static void merge_abs(struct abs_ranges *ranges, unsigned int code,
+		const struct input_absinfo *info) {
+	struct input_absinfo *range = ranges->info + code;
+
+	if (!(ranges->used & 1ull << code)) {
+		*range = *info;
+		ranges->used |= 1ull << code;
+		return;
+	}
+	if (info->minimum < range->minimum)
+		range->minimum = info->minimum;
+	if (info->maximum > range->maximum)
+		range->maximum = info->maximum;
+	if (info->fuzz < range->fuzz)
+		range->fuzz = info->fuzz;
+	if (info->flat < range->flat)
+		range->flat = info->flat;
+}
+
+/*
+ * Enable the outputs of a table of key entries. An ABS_ output takes the
+ * range of the axis on its code, if there is one.
+ */
+static void enable_keys(struct libevdev *evdev, const struct key_entry *table, int len,
+		struct abs_ranges *ranges) {
+	int i, j, k;
+
+	for (i = 0; i < len; ++i) {
+		if (EV_ABS == table[i].type) {
+			if (!(ranges->used & 1ull << table[i].code))
+				merge_abs(ranges, table[i].code, &default_absinfo);
+		} else if (table[i].type) {
+			libevdev_enable_event_code(evdev, table[i].type, table[i].code, NULL);
+		}
+		for (j = 0; j < table[i].macro_len; ++j) {
+			for (k = 0; k < table[i].macro[j].len; ++k)
+				libevdev_enable_event_code(evdev, EV_KEY, table[i].macro[j].codes[k], NULL);
+		}
+	}
+}
+
+static void enable_axes(struct libevdev *evdev, const struct axis_entry *axistable,
+		struct abs_ranges *ranges) {
+	struct input_absinfo axis_absinfo = default_absinfo;
+	int i;
+
+	for (i = 0; i < AXIS_NUM; ++i) {
+		if (EV_ABS == axistable[i].type) {
+			axis_absinfo.minimum = axistable[i].min;
+			axis_absinfo.maximum = axistable[i].max;
+			axis_absinfo.fuzz = axistable[i].fuzz;
+			axis_absinfo.flat = axistable[i].flat;
+			merge_abs(ranges, axistable[i].code, &axis_absinfo);
+		} else if (EV_REL == axistable[i].type) {
+			libevdev_enable_event_code(evdev, EV_REL, axistable[i].code, NULL);
+		}
+	}
+}
+
+/*
+ * Enable the outputs of a keymap, and add the ranges of its ABS_ codes to
+ * ranges
+ */
+static void enable_keymap(struct libevdev *evdev, const struct keymap *keymap,
+		struct abs_ranges *ranges) {
+	struct abs_ranges own = { .used = 0 };
+	unsigned int code;
+
+	enable_axes(evdev, keymap->axes, &own);
+	enable_keys(evdev, keymap->keys, XWII_KEY_NUM, &own);
+	enable_keys(evdev, keymap->combos.outputs, COMBOS_MAX, &own);
+	// Where the nunchuk stick is passed through, unless mapped
+	if (!(own.used & 1ull << ABS_X))
+		merge_abs(&own, ABS_X, &default_absinfo);
+	if (!(own.used & 1ull << ABS_Y))
+		merge_abs(&own, ABS_Y, &default_absinfo);
+
+	for (code = 0; code < ABS_CNT; ++code) {
+		if (own.used & 1ull << code)
+			merge_abs(ranges, code, own.info + code);
+	}
+}
+
+/*
+ * Whether any of the given axis sources is mapped in any keymap
+ */
+static int axes_mapped(const struct keymaps *keymaps, unsigned int sources) {
 	int i;
 
-	assert(NULL == uinput_dev);
+	for (i = 0; i < AXIS_NUM; ++i) {
+		if ((sources & 1u << i) && (keymaps->core.axes[i].type
+				|| keymaps->nunchuk.axes[i].type || keymaps->classic.axes[i].type))
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Interfaces to open: the extensions, and the sensors needed by mapped axes
+ */
+static unsigned int find_wanted_ifaces(const struct keymaps *keymaps) {
+	unsigned int ifaces = SUPPORTED_IFACES;
+
+	if (axes_mapped(keymaps, ACCEL_AXES))
+		ifaces |= XWII_IFACE_ACCEL;
+	if (axes_mapped(keymaps, IR_AXES))
+		ifaces |= XWII_IFACE_IR;
+	// The accelerometer corrects the drift of the MotionPlus
+	if (axes_mapped(keymaps, MP_AXES))
+		ifaces |= XWII_IFACE_MOTION_PLUS | XWII_IFACE_ACCEL;
+	return ifaces;
+}
+
+/*
+ * Describe the virtual gamepad of a device using the given keymap
+ */
+static struct libevdev *describe_evdev(const struct keymaps *keymaps,
+		const struct keymap *keymap) {
+	struct libevdev *evdev;
+	struct abs_ranges ranges = { .used = 0 };
+	const struct controller_data *controller = &keymap->controller;
+	unsigned int code;
+
+	// A persistent device is identified as the core Wiimote
+	if (persistent)
+		controller = &keymaps->core.controller;
 
 	evdev = libevdev_new();
-	// Axis parameters
-	absinfo.value = 0;
-	absinfo.minimum = -ABSMAX;
-	absinfo.maximum = ABSMAX;
-	absinfo.fuzz = 2;
-	absinfo.flat = 4;
-	absinfo.resolution = 1;
+	if (!evdev)
+		w2g_fail("Unable to allocate evdev device\n");
 	// Set product id
-	libevdev_set_name(evdev, controller_data->name);
-	libevdev_set_id_vendor(evdev, controller_data->vendor);
-	libevdev_set_id_product(evdev, controller_data->product);
-	// Enable axis events
+	libevdev_set_name(evdev, controller->name);
+	libevdev_set_id_vendor(evdev, controller->vendor);
+	libevdev_set_id_product(evdev, controller->product);
+	// Enable key and axis events
 	libevdev_enable_event_type(evdev, EV_ABS);
-	libevdev_enable_event_code(evdev, EV_ABS, ABS_X, &absinfo);
-	libevdev_enable_event_code(evdev, EV_ABS, ABS_Y, &absinfo);
-	// Enable key events
 	libevdev_enable_event_type(evdev, EV_KEY);
-	for (i = 0; i < XWII_KEY_NUM; ++i) {
-		switch (keymap[i].intype) {
-			case IN_TYPE_NONE:
-				break;
-			case IN_TYPE_KEY_OR_BTN:
-				libevdev_enable_event_code(evdev, EV_KEY, keymap[i].input, NULL);
-				break;
-			case IN_TYPE_REL:
-				libevdev_enable_event_code(evdev, EV_REL, keymap[i].input, NULL);
-				break;
-			case IN_TYPE_ABS:
-				libevdev_enable_event_code(evdev, EV_ABS, keymap[i].input, &absinfo);
-				break;
-			default:
-				w2g_fail("Unsupported intype %d\n", keymap[i].intype);
-		}
+	if (persistent) {
+		// Advertise every code any extension can produce
+		enable_keymap(evdev, &keymaps->core, &ranges);
+		enable_keymap(evdev, &keymaps->nunchuk, &ranges);
+		enable_keymap(evdev, &keymaps->classic, &ranges);
+	} else {
+		enable_keymap(evdev, keymap, &ranges);
+	}
+	// Axes are enabled once their ranges are known
+	for (code = 0; code < ABS_CNT; ++code) {
+		if (ranges.used & 1ull << code)
+			libevdev_enable_event_code(evdev, EV_ABS, code, ranges.info + code);
 	}
+	return evdev;
+}
+
+static void init_evdev(struct device *dev) {
+	struct libevdev *evdev;
+	int ret;
 
-	ret = libevdev_uinput_create_from_device(evdev, LIBEVDEV_UINPUT_OPEN_MANAGED, &uinput_dev); 
+	assert(NULL == dev->uinput_dev);
+
+	evdev = describe_evdev(keymaps, dev->keymap);
+	ret = libevdev_uinput_create_from_device(evdev, LIBEVDEV_UINPUT_OPEN_MANAGED, &dev->uinput_dev); 
 	if (ret) {
 		libevdev_free(evdev);
 		w2g_error(ret, "libevdev_uinput_create_from_device");
@@ -173,53 +547,301 @@ static void init_evdev() {
 	libevdev_free(evdev);
 }
 
-void load_keymap() {
-	int available_ifaces = xwii_iface_available(iface) & SUPPORTED_IFACES;
-	int opened_ifaces = xwii_iface_opened(iface);
-	int tries = 0;
-	int err;
+/*
+ * Whether two descriptions give the same gamepad, so that a device created
+ * from one can be used as the other
+ */
+static int same_evdev(const struct libevdev *a, const struct libevdev *b) {
+	static const unsigned int max_codes[] = {
+		[EV_KEY] = KEY_MAX,
+		[EV_REL] = REL_MAX,
+		[EV_ABS] = ABS_MAX,
+	};
+	const struct input_absinfo *abs_a, *abs_b;
+	unsigned int type, code;
 
-	// Reopen devices
-	// Have to repeatedly open interfaces because sometimes they aren't
-	// immediately available
-	while (err = xwii_iface_open(iface, available_ifaces)) {
-		if (max_retries < ++tries) // True whenever the wiimote disconnects
-			break;
-		printf("Unable to open interfaces, retrying...\n");
-		sleep(1);
-	}
+	if (libevdev_get_id_vendor(a) != libevdev_get_id_vendor(b)
+			|| libevdev_get_id_product(a) != libevdev_get_id_product(b)
+			|| strcmp(libevdev_get_name(a) ? libevdev_get_name(a) : "",
+				libevdev_get_name(b) ? libevdev_get_name(b) : ""))
+		return false;
 
-	opened_ifaces = xwii_iface_opened(iface);
+	for (type = EV_KEY; type <= EV_ABS; ++type) {
+		if (libevdev_has_event_type(a, type) != libevdev_has_event_type(b, type))
+			return false;
+		for (code = 0; code <= max_codes[type]; ++code) {
+			if (libevdev_has_event_code(a, type, code) != libevdev_has_event_code(b, type, code))
+				return false;
+		}
+	}
 
-	if ((opened_ifaces & available_ifaces) != available_ifaces) {
-		printf("Unable to open some interfaces\n");
+	for (code = 0; code <= ABS_MAX; ++code) {
+		abs_a = libevdev_get_abs_info(a, code);
+		abs_b = libevdev_get_abs_info(b, code);
+		if (abs_a && abs_b && (abs_a->minimum != abs_b->minimum
+				|| abs_a->maximum != abs_b->maximum || abs_a->fuzz != abs_b->fuzz
+				|| abs_a->flat != abs_b->flat))
+			return false;
 	}
+	return true;
+}
 
-	if (opened_ifaces & XWII_IFACE_CLASSIC_CONTROLLER) {
-		keymap = keymap_classic;
-		controller_data = &controller_classic;
-	} else if (opened_ifaces & XWII_IFACE_NUNCHUK) {
-		keymap = keymap_nunchuk;
-		controller_data = &controller_nunchuk;
+static void record_event(const struct xwii_event *ev, unsigned int ifaces) {
+	int ret = trace_write(trace_file, ev, ifaces);
+	if (ret)
+		w2g_error(ret, "Unable to write trace");
+}
+
+/*
+ * Record a keymap switch. Interfaces may be opened some time after the watch
+ * event, so the record is stamped when the switch happens.
+ */
+static void record_watch(unsigned int opened_ifaces) {
+	struct xwii_event ev = { .type = XWII_EVENT_WATCH };
+
+	gettimeofday(&ev.time, NULL);
+	record_event(&ev, opened_ifaces);
+}
+
+static void release_keys(struct device *dev, const struct keymap *keymap);
+static inline void emit_sync(struct device *dev);
+static void release_combos(struct device *dev, uint32_t keys);
+
+static const struct keymap *find_keymap(const struct keymaps *keymaps,
+		unsigned int opened_ifaces) {
+	if (opened_ifaces & XWII_IFACE_CLASSIC_CONTROLLER)
+		return &keymaps->classic;
+	if (opened_ifaces & XWII_IFACE_NUNCHUK)
+		return &keymaps->nunchuk;
+	return &keymaps->core;
+}
+
+/*
+ * Stop the turbos, macros and combinations of the device's keymap, which
+ * play its entries
+ */
+static void stop_keymap(struct device *dev) {
+	cancel_key_timers(dev, true);
+	release_combos(dev, ~0u);
+	emit_sync(dev);
+}
+
+static void reset_axes(struct device *dev) {
+	memset(dev->axes, 0, sizeof(dev->axes));
+	memset(&dev->pointer, 0, sizeof(dev->pointer));
+	dev->motion.usec = 0; // Relative axes restart from here
+}
+
+/*
+ * Switch to the keymap for the given set of opened interfaces, without
+ * logging it
+ */
+static void switch_keymap(struct device *dev, unsigned int opened_ifaces) {
+	const struct keymap *old_keymap = dev->keymap;
+
+	if (old_keymap)
+		stop_keymap(dev);
+	dev->keys_held = 0;
+	dev->keys_absorbed = 0;
+
+	dev->keymap = find_keymap(keymaps, opened_ifaces);
+	dev->ifaces = opened_ifaces;
+
+	if (persistent && old_keymap) {
+		// Keep the device, but don't leave the old keymap's outputs held
+		if (old_keymap != dev->keymap) {
+			release_keys(dev, old_keymap);
+			reset_axes(dev);
+		}
 	} else {
-		keymap = keymap_core;
-		controller_data = &controller_core;
+		// Reload evdev device
+		if (SINK_UINPUT == output.type) {
+			cleanup_evdev(dev);
+			init_evdev(dev);
+		}
+		reset_axes(dev);
 	}
+}
 
-	// Reload evdev device
-	cleanup_evdev();
-	init_evdev();
+/*
+ * Switch to the keymap for the given set of opened interfaces
+ */
+void select_keymap(struct device *dev, unsigned int opened_ifaces) {
+	const struct keymap *old_keymap = dev->keymap;
+	int64_t start_ns = time_ns();
+
+	switch_keymap(dev, opened_ifaces);
+
+	if (trace_file)
+		record_watch(opened_ifaces);
 
 	if (opened_ifaces & XWII_IFACE_CLASSIC_CONTROLLER) {
-		printf("Using Classic Controller\n");
+		printf("Wiimote %d: Using Classic Controller\n", dev->num);
 	} else if (opened_ifaces & XWII_IFACE_NUNCHUK) {
-		printf("Using Wiimote and Nunchuk\n");
+		printf("Wiimote %d: Using Wiimote and Nunchuk\n", dev->num);
 	} else if (opened_ifaces & XWII_IFACE_CORE) {
-		printf("Using Core Wiimote\n");
+		printf("Wiimote %d: Using Core Wiimote\n", dev->num);
+	}
+
+	if (old_keymap)
+		printf("Wiimote %d: Switched keymap in %.3f ms\n",
+				dev->num, (time_ns() - start_ns) / 1e6);
+}
+
+/*
+ * Replace the keymaps with reloaded ones. Devices keep using the previous
+ * keymaps until reload_device() moves them, which happens before any of
+ * their later events are translated, and the previous keymaps are freed on
+ * the next reload.
+ */
+static void install_keymaps(struct keymaps *reloaded, int64_t start_ns) {
+	free_keymaps(retired_keymaps);
+	retired_keymaps = keymaps;
+	keymaps = reloaded;
+	printf("Reloaded keymap in %.3f ms\n", (time_ns() - start_ns) / 1e6);
+}
+
+/*
+ * Move a device to the installed keymaps, releasing whatever it held under
+ * the previous ones. The virtual gamepad is only recreated if the new
+ * keymap changes its outputs.
+ */
+static void reload_device(struct device *dev) {
+	const struct keymap *keymap;
+	struct libevdev *old_evdev, *new_evdev;
+	int same;
+
+	// Selected once its interfaces are open
+	if (!dev->keymap)
+		return;
+
+	stop_keymap(dev);
+	dev->keys_held = 0;
+	dev->keys_absorbed = 0;
+	release_keys(dev, dev->keymap);
+	reset_axes(dev);
+
+	keymap = find_keymap(keymaps, dev->ifaces);
+	if (SINK_UINPUT == output.type && dev->uinput_dev) {
+		old_evdev = describe_evdev(retired_keymaps, dev->keymap);
+		new_evdev = describe_evdev(keymaps, keymap);
+		same = same_evdev(old_evdev, new_evdev);
+		libevdev_free(old_evdev);
+		libevdev_free(new_evdev);
+		dev->keymap = keymap;
+		if (!same) {
+			cleanup_evdev(dev);
+			init_evdev(dev);
+			printf("Wiimote %d: Outputs changed, recreated the gamepad\n", dev->num);
+		}
+	} else {
+		dev->keymap = keymap;
+	}
+}
+
+/*
+ * Try to open every available interface. Returns true if all of them are
+ * open.
+ */
+static int open_ifaces(struct device *dev) {
+	int available_ifaces = xwii_iface_available(dev->iface) & wanted_ifaces;
+
+	// Interfaces which were opened stay open even if others fail
+	xwii_iface_open(dev->iface, available_ifaces);
+	return (xwii_iface_opened(dev->iface) & available_ifaces) == available_ifaces;
+}
+
+static void set_reopen_timer(struct device *dev, int delay_ms) {
+	struct itimerspec its = {
+		.it_value = {
+			.tv_sec = delay_ms / 1000,
+			.tv_nsec = delay_ms % 1000 * 1000000L,
+		},
+	};
+
+	if (-1 == timerfd_settime(dev->reopen_source.fd, 0, &its, NULL))
+		w2g_error(errno, "Unable to set reopen timer");
+}
+
+static void queue_switch(struct device *dev, unsigned int opened_ifaces);
+
+/*
+ * Switch to the keymap of the open interfaces, after the events read so far
+ */
+static void switch_opened(struct device *dev) {
+	dev->selected = true;
+	if (threaded)
+		queue_switch(dev, xwii_iface_opened(dev->iface));
+	else
+		select_keymap(dev, xwii_iface_opened(dev->iface));
+}
+
+static void finish_reopen(struct device *dev, int ready) {
+	if (!ready)
+		printf("Wiimote %d: Unable to open some interfaces\n", dev->num);
+
+	if (dev->reopen_tries) {
+		printf("Wiimote %d: Reopen took %.1f ms, %lu events handled meanwhile, %lu dropped\n",
+				dev->num, (time_ns() - dev->reopen_start_ns) / 1e6,
+				__atomic_load_n(&dev->reopen_events, __ATOMIC_RELAXED),
+				__atomic_load_n(&dev->reopen_dropped, __ATOMIC_RELAXED));
+		__atomic_store_n(&dev->reopen_tries, 0, __ATOMIC_RELAXED);
+		set_reopen_timer(dev, 0);
+	}
+
+	switch_opened(dev);
+}
+
+/*
+ * Open the available interfaces and switch to their keymap. Interfaces
+ * sometimes aren't immediately available, so failed opens are retried from
+ * the event loop while events keep being translated with the old keymap.
+ */
+void load_keymap(struct device *dev) {
+	if (open_ifaces(dev)) {
+		finish_reopen(dev, true);
+		return;
+	}
+	if (max_retries <= 0) {
+		finish_reopen(dev, false);
+		return;
+	}
+
+	printf("Wiimote %d: Unable to open interfaces, retrying...\n", dev->num);
+	// A new device has no keymap to translate with meanwhile, so it starts
+	// with the interfaces which did open
+	if (!dev->selected)
+		switch_opened(dev);
+	if (!dev->reopen_tries) {
+		dev->reopen_start_ns = time_ns();
+		__atomic_store_n(&dev->reopen_events, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&dev->reopen_dropped, 0, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&dev->reopen_tries, 1, __ATOMIC_RELAXED);
+	set_reopen_timer(dev, REOPEN_DELAY_MS);
+}
+
+static void dispatch_reopen(struct source *source) {
+	struct device *dev = container_of(source, struct device, reopen_source);
+	uint64_t expirations;
+	int delay_ms;
+
+	if (-1 == read(source->fd, &expirations, sizeof(expirations)) || !dev->reopen_tries)
+		return;
+
+	if (open_ifaces(dev)) {
+		finish_reopen(dev, true);
+	} else if (max_retries <= dev->reopen_tries) {
+		// True whenever the wiimote disconnects
+		finish_reopen(dev, false);
+	} else {
+		delay_ms = REOPEN_DELAY_MS << dev->reopen_tries;
+		__atomic_store_n(&dev->reopen_tries, dev->reopen_tries + 1, __ATOMIC_RELAXED);
+		set_reopen_timer(dev, delay_ms < REOPEN_MAX_DELAY_MS ? delay_ms : REOPEN_MAX_DELAY_MS);
 	}
 }
 
-static void init_wiimote(const char *devpath) {
+static int init_wiimote(struct device *dev, const char *devpath) {
 	int ret;
 	sigset_t blockset, oldset;
 
@@ -228,165 +850,1716 @@ static void init_wiimote(const char *devpath) {
 	sigaddset(&blockset, SIGINT);
 	sigprocmask(SIG_BLOCK, &blockset, &oldset);
 
-	ret = xwii_iface_new(&iface, devpath);
-	if (ret)
-		w2g_error(ret, "Error initializing iface");
+	ret = xwii_iface_new(&dev->iface, devpath);
+	if (ret) {
+		w2g_warn(ret, "Error initializing iface");
+		goto out;
+	}
 
 	// From xwiishow.c
-	ret = xwii_iface_watch(iface, true);
-	if (ret)
-		w2g_error(ret, "Error: Cannot initialize hotplug watch descriptor");
+	ret = xwii_iface_watch(dev->iface, true);
+	if (ret) {
+		w2g_warn(ret, "Error: Cannot initialize hotplug watch descriptor");
+		goto out;
+	}
 
-	load_keymap();
+	load_keymap(dev);
 
+out:
 	// Restore signal mask
 	sigprocmask(SIG_SETMASK, &oldset, NULL);
+	return ret;
 }
 
-// Event handlers
+static void dispatch_device(struct source *source);
+static void read_device(struct source *source);
 
-void handle_move(const struct xwii_event *ev) {
-	const struct xwii_event_abs *absev = &ev->v.abs[0];
-	libevdev_uinput_write_event(uinput_dev, EV_ABS, ABS_X, absev->x);
-	libevdev_uinput_write_event(uinput_dev, EV_ABS, ABS_Y, -absev->y); // Inverted
-	libevdev_uinput_write_event(uinput_dev, EV_SYN, SYN_REPORT, 0);
+/*
+ * Open the Wiimote at path and add it to the event loop. Takes ownership of
+ * path. Returns NULL if the Wiimote could not be opened.
+ */
+static struct device *add_device(int num, char *path) {
+	struct device *dev;
+	int ret;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		w2g_error(errno, "Unable to allocate device");
+	dev->num = num;
+	dev->path = path;
+	dev->next = devices;
+	devices = dev;
+
+	dev->reopen_source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (-1 == dev->reopen_source.fd)
+		w2g_error(errno, "Unable to create reopen timer");
+	dev->reopen_source.dispatch = dispatch_reopen;
+	ret = loop_add(&dev->reopen_source);
+	if (ret)
+		w2g_error(ret, "Unable to watch reopen timer");
+
+	if (init_wiimote(dev, path)) {
+		remove_device(dev);
+		return NULL;
+	}
+
+	dev->source.fd = xwii_iface_get_fd(dev->iface);
+	dev->source.dispatch = threaded ? read_device : dispatch_device;
+	ret = loop_add(&dev->source);
+	if (ret)
+		w2g_error(ret, "Unable to watch wiimote");
+
+	return dev;
 }
 
-void handle_key(const struct xwii_event *ev) {
-	const struct xwii_event_key *keyev = &ev->v.key;
-	
-	struct map_data *mdata = keymap + keyev->code;
-	
-	int val;
+/*
+ * Attach Wiimotes announced by the hotplug monitor
+ */
+static void dispatch_monitor(struct source *source) {
+	int64_t appeared_ns = time_ns();
+	struct device *dev;
+	char *path;
 
-	switch (mdata->intype) {
-	case IN_TYPE_NONE:
-		printf("Unmapped input\n");
-		for (int i = 0; i < XWII_KEY_NUM; ++i) {
-			printf("%d ", keymap[i].input);
+	while ((path = xwii_monitor_poll(monitor))) {
+		for (dev = devices; dev; dev = dev->next) {
+			if (!strcmp(dev->path, path))
+				break;
 		}
-		printf("\n");
-		break;
-	case IN_TYPE_KEY_OR_BTN:
-		if (keyev->state < 2) {
-			// Treat as button
-			val = mdata->reversed ? !keyev->state : keyev->state;
-			libevdev_uinput_write_event(uinput_dev, EV_KEY, mdata->input, val);
+		if (dev) {
+			free(path);
+			continue;
 		}
-		break;
-	case IN_TYPE_REL:
-		w2g_fail("REL inputs are unsupported\n");
-	case IN_TYPE_ABS:
-		if (keyev->state) {
-			val = ABSMAX;
-			if (mdata->reversed)
-				val = -val;
-		} else {
-			val = 0;
+
+		dev = add_device(next_num, path);
+		if (!dev) {
+			fprintf(stderr, "Unable to attach wiimote %d\n", next_num);
+			continue;
 		}
-		libevdev_uinput_write_event(uinput_dev, EV_ABS, mdata->input, val);
-		break;
-	default:
-		w2g_fail("Unsupported input type %d\n", mdata->intype);
+		++next_num;
+		dev->appeared_ns = appeared_ns;
+		printf("Wiimote %d attached in %.3f ms\n", dev->num,
+				(time_ns() - appeared_ns) / 1e6);
 	}
-	if (mdata->intype) {
-		libevdev_uinput_write_event(uinput_dev, EV_SYN, SYN_REPORT, 0);
+}
+
+static void init_monitor() {
+	int ret;
+
+	monitor = xwii_monitor_new(true, false);
+	if (!monitor)
+		w2g_fail("Cannot create monitor\n");
+
+	monitor_source.fd = xwii_monitor_get_fd(monitor, false);
+	if (monitor_source.fd < 0)
+		w2g_fail("Cannot get monitor descriptor\n");
+	monitor_source.dispatch = dispatch_monitor;
+	ret = loop_add(&monitor_source);
+	if (ret)
+		w2g_error(ret, "Unable to watch monitor");
+
+	// Attach Wiimotes which are already connected
+	dispatch_monitor(&monitor_source);
+}
+
+// Output
+
+static void record_latency(struct device *dev) {
+	struct timespec now;
+	int64_t now_usec, usec;
+	int i;
+
+	// Event timestamps come from the kernel's real time clock
+	clock_gettime(CLOCK_REALTIME, &now);
+	now_usec = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+	for (i = 0; i < dev->frame_sources_len; ++i) {
+		usec = now_usec - dev->frame_sources[i].usec;
+		hist_record(latency + dev->frame_sources[i].type, usec > 0 ? usec : 0);
 	}
+	dev->frame_sources_len = 0;
 }
 
+static void record_wakeup(const struct xwii_event *ev) {
+	struct timespec now;
+	int64_t usec;
 
-int main(int argc, const char *argv[]) {
-	const char *devnum_str = NULL;
-	int devnum;
-	char *path;
-	const char *keymap_path = NULL;
-	const char *max_retries_str = NULL;
+	clock_gettime(CLOCK_REALTIME, &now);
+	usec = (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000
+			- ((int64_t) ev->time.tv_sec * 1000000 + ev->time.tv_usec);
+	hist_record(&wakeup_latency, usec > 0 ? usec : 0);
+}
+
+static void print_histogram(const char *name, const struct histogram *hist) {
+	printf("%-14s %10lu %8lu %8lu %8lu %8lu\n",
+			name,
+			(unsigned long) hist->count,
+			(unsigned long) hist_percentile(hist, 0.5),
+			(unsigned long) hist_percentile(hist, 0.99),
+			(unsigned long) hist_percentile(hist, 0.999),
+			(unsigned long) hist->max);
+}
+
+static void print_latency() {
 	int i;
-	int ret;
 
-	// Parse arguments
-	for (i = 1; i < argc; ++i) {
-		if (!strcmp("-m", argv[i])) {
-			if (keymap_path)
-				w2g_fail("Repeat option -m\n");
-			keymap_path = argv[++i];
-		} else if (!strcmp("-r", argv[i])) {
-			if (max_retries_str)
-				w2g_fail("Repeat option -r\n");
-			max_retries_str = argv[++i];
-		} else {
-			if (devnum_str)
-				w2g_fail("Too many wiimotes specified\n");
-			devnum_str = argv[i];
-		}
+	printf("Latency (us)        count      p50      p99    p99.9      max\n");
+	for (i = 0; i < XWII_EVENT_NUM; ++i) {
+		if (latency[i].count)
+			print_histogram(event_names[i] ? event_names[i] : "Other", latency + i);
 	}
-	if (!devnum_str)
-		w2g_fail("Usage: wii2gamepad [-m <keymap>] [-r <max retries>] <wiimote number>\n");
+	// Scheduling jitter of the event loop
+	if (wakeup_latency.count)
+		print_histogram("Wakeup", &wakeup_latency);
+	if (pipeline.queued.count)
+		print_histogram("Queued", &pipeline.queued);
+	// How late turbos and macros fire
+	if (timer_stats.late.count)
+		print_histogram("Timer", &timer_stats.late);
 
-	if (!keymap_path) {
-		keymap_path = DEFAULT_KEYMAP_PATH;
+	if (threaded) {
+		printf("Queue depth p50 %lu, p99 %lu, max %lu, %lu events overflowed\n",
+				(unsigned long) hist_percentile(&pipeline.depth, 0.5),
+				(unsigned long) hist_percentile(&pipeline.depth, 0.99),
+				(unsigned long) pipeline.depth.max,
+				__atomic_load_n(&pipeline.overflows, __ATOMIC_RELAXED));
 	}
-	init_keymap(keymap_path);
+	if (timer_stats.fired)
+		printf("Fired %lu timers in %lu wakeups\n", timer_stats.fired, timer_stats.wakeups);
+}
 
-	if (max_retries_str)
-		max_retries = atoi(max_retries_str);
-	devnum = atoi(devnum_str);
-	path = get_dev(devnum);
+/*
+ * Write the buffered frame to the output in one syscall. This is what
+ * libevdev_uinput_write_event() does for each event. With io_uring the write
+ * is only queued, so latency is measured up to the queueing.
+ */
+static void flush_frame(struct device *dev) {
+	size_t len = dev->frame_len;
+	int fd;
+	int ret;
 
-	// Set up cleanup
-	struct sigaction sa = {
-		.sa_handler = sighandler,
-		.sa_mask = 0,
-		.sa_flags = 0
-	};
-	sigaction(SIGINT, &sa, NULL);
+	if (!dev->frame_len)
+		return;
+	dev->frame_len = 0;
+	++stats.flushes;
 
-	// Initializes the wiimote and the evdev object
-	init_wiimote(path);
+	if (SINK_NULL == output.type)
+		return;
 
-	struct pollfd pfd;
-	pfd.fd = xwii_iface_get_fd(iface);
-	pfd.events = POLL_IN;
+	fd = SINK_UINPUT == output.type ? libevdev_uinput_get_fd(dev->uinput_dev) : -1;
+	ret = sink_write(&output, fd, dev->frame, len);
+	if (ret)
+		w2g_error(ret, "Unable to write output");
 
-	struct xwii_event ev;
+	if (dev->frame_sources_len)
+		record_latency(dev);
+}
 
-	printf("Running (Press Ctrl-C to terminate)\n");
-	
-	while (1) {
-		// Wait for an event
-		ret = poll(&pfd, 1, -1);
-		if (-1 == ret) {
-			if (EINTR == errno) {
-				cleanup();
-				exit(EXIT_SUCCESS);
-			}
-			w2g_error(errno, "Unable to poll wiimote");
-		}
+static inline void write_event(struct device *dev, unsigned int type, unsigned int code, int value) {
+	struct input_event *iev;
 
-		ret = xwii_iface_dispatch(iface, &ev, sizeof(ev));
+	if (FRAME_MAX == dev->frame_len)
+		flush_frame(dev);
 
-		if (ret) {
-			if (-EAGAIN == ret)
-				continue;
-			w2g_error(ret, "Unable to dispatch wiimote event");
-		}
+	// Timestamps are filled in by the kernel
+	iev = dev->frame + dev->frame_len++;
+	iev->input_event_sec = 0;
+	iev->input_event_usec = 0;
+	iev->type = type;
+	iev->code = code;
+	iev->value = value;
+}
 
-		switch (ev.type) {
-		case XWII_EVENT_GONE:
-			// Device is gone
-			printf("Wiimote has disconnected\n");
-			cleanup();
-			exit(EXIT_SUCCESS);
-		case XWII_EVENT_WATCH:
-			load_keymap();
-			break;
-		case XWII_EVENT_NUNCHUK_MOVE:
-			handle_move(&ev);
-			break;
-		case XWII_EVENT_KEY:
-		case XWII_EVENT_NUNCHUK_KEY:
-			handle_key(&ev);
-			break;
-		}
+static inline void emit(struct device *dev, unsigned int type, unsigned int code, int value) {
+	const struct xwii_event *ev = dev->event;
+
+	write_event(dev, type, code, value);
+	++stats.writes;
+	dev->frame_pending = true;
+
+	// Note the first output of each event
+	if (ev) {
+		dev->frame_sources[dev->frame_sources_len].type = ev->type;
+		dev->frame_sources[dev->frame_sources_len].usec =
+				(int64_t) ev->time.tv_sec * 1000000 + ev->time.tv_usec;
+		++dev->frame_sources_len;
+		dev->event = NULL;
 	}
 }
+
+/*
+ * End the current frame with a SYN_REPORT, if anything was written.
+ */
+static inline void emit_sync(struct device *dev) {
+	if (!dev->frame_pending)
+		return;
+	write_event(dev, EV_SYN, SYN_REPORT, 0);
+	flush_frame(dev);
+	++stats.syncs;
+	dev->frame_pending = false;
+	dev->frame_keys = 0;
+
+	if (dev->appeared_ns) {
+		printf("Wiimote %d forwarded its first event %.3f ms after appearing\n",
+				dev->num, (time_ns() - dev->appeared_ns) / 1e6);
+		dev->appeared_ns = 0;
+	}
+}
+
+/*
+ * Return every output of a keymap, and the nunchuk stick, to rest
+ */
+static void release_keys(struct device *dev, const struct keymap *keymap) {
+	const struct key_entry *keytable = keymap->keys;
+	const struct axis_entry *axistable = keymap->axes;
+	int i;
+
+	emit_sync(dev);
+	for (i = 0; i < XWII_KEY_NUM; ++i) {
+		if (keytable[i].states)
+			emit(dev, keytable[i].type, keytable[i].code, keytable[i].value[0]);
+	}
+	for (i = 0; i < AXIS_NUM; ++i) {
+		if (EV_ABS == axistable[i].type)
+			emit(dev, axistable[i].type, axistable[i].code,
+					axistable[i].lut ? axistable[i].lut[AXIS_LUT_SIZE / 2] : 0);
+	}
+	emit(dev, EV_ABS, ABS_X, 0);
+	emit(dev, EV_ABS, ABS_Y, 0);
+	emit_sync(dev);
+}
+
+static void print_stats() {
+	unsigned long syscalls, unbatched;
+
+	if (stats.syncs) {
+		// Writing each event separately costs one syscall per event
+		printf("Wrote %lu frames: %.2f writes/frame (%.2f writing each event)\n",
+				stats.syncs, (double) stats.flushes / stats.syncs,
+				(double) (stats.writes + stats.syncs) / stats.syncs);
+	}
+
+	if ((!batch_dispatch && LOOP_URING != loop_backend) || !stats.events)
+		return;
+
+	syscalls = __atomic_load_n(&loop_syscalls, __ATOMIC_RELAXED) + stats.dispatches;
+	// Unbatched, every event costs a poll, a dispatch, a write for each
+	// event it produces and a sync. Timers cost a poll and their frames.
+	unbatched = 2 * stats.events + stats.writes + stats.reports
+			+ timer_stats.wakeups + timer_stats.syncs;
+	printf("Dispatched %lu events in %lu wakeups, %lu frames\n",
+			stats.events, stats.polls, stats.syncs);
+	printf("%.2f syscalls/event (%.2f unbatched), saved %.2f syscalls/event\n",
+			(double) syscalls / stats.events,
+			(double) unbatched / stats.events,
+			((double) unbatched - syscalls) / stats.events);
+}
+
+// Turbo and macros
+
+/*
+ * Current time, or the time of the replayed event
+ */
+static inline int64_t timer_clock_ns() {
+	return replay_clock_ns >= 0 ? replay_clock_ns : time_ns();
+}
+
+/*
+ * Set the timerfd for the next due tick, if it changed
+ */
+static void arm_timers() {
+	struct itimerspec its = { 0 };
+	uint64_t next = wheel_next(&wheel);
+	int64_t ns;
+
+	if (next == timer_armed)
+		return;
+	timer_armed = next;
+	if (-1 == timer_source.fd)
+		return;
+
+	// Disarmed if nothing is pending
+	if (UINT64_MAX != next) {
+		ns = timer_epoch_ns + (int64_t) next * TIMER_TICK_NS;
+		its.it_value.tv_sec = ns / 1000000000;
+		its.it_value.tv_nsec = ns % 1000000000;
+	}
+	if (-1 == timerfd_settime(timer_source.fd, TFD_TIMER_ABSTIME, &its, NULL))
+		w2g_error(errno, "Unable to set timer");
+}
+
+static inline int timers_due() {
+	return UINT64_MAX != timer_armed
+			&& timer_clock_ns() >= timer_epoch_ns + (int64_t) timer_armed * TIMER_TICK_NS;
+}
+
+/*
+ * Fire a key timer at due_ns, on the first tick after it
+ */
+static void schedule_key(struct key_timer *kt, int64_t due_ns) {
+	int64_t now_ns = timer_clock_ns();
+
+	// An idle wheel is left behind. Catch it up, so short timers aren't put
+	// in the coarse levels.
+	if (UINT64_MAX == wheel_next(&wheel) && now_ns > timer_epoch_ns)
+		wheel_advance(&wheel, (now_ns - timer_epoch_ns) / TIMER_TICK_NS);
+
+	kt->due_ns = due_ns;
+	wheel_add(&wheel, &kt->timer,
+			(due_ns - timer_epoch_ns + TIMER_TICK_NS - 1) / TIMER_TICK_NS);
+	arm_timers();
+}
+
+/*
+ * Press or release every key of a macro step
+ */
+static void emit_step(struct device *dev, const struct macro_step *step, int value) {
+	int i;
+
+	for (i = 0; i < step->len; ++i)
+		emit(dev, EV_KEY, step->codes[i], value);
+}
+
+static void fire_key(struct timer *timer) {
+	struct key_timer *kt = container_of(timer, struct key_timer, timer);
+	const struct key_entry *entry = kt->entry;
+	const struct macro_step *step;
+	struct device *dev = kt->dev;
+
+	++timer_stats.fired;
+	if (measure_latency)
+		hist_record(&timer_stats.late,
+				timer_now_ns > kt->due_ns ? (timer_now_ns - kt->due_ns) / 1000 : 0);
+
+	if (!dev->timer_synced) {
+		dev->timer_synced = true;
+		dev->timer_next = timer_synced;
+		timer_synced = dev;
+	}
+
+	if (!entry->macro) {
+		// Due times are kept exact, so the rate doesn't drift
+		kt->on = !kt->on;
+		emit(dev, entry->type, entry->code, entry->value[kt->on]);
+		schedule_key(kt, kt->due_ns + entry->turbo_ns);
+		return;
+	}
+
+	step = entry->macro + kt->step;
+	emit_step(dev, step, 0);
+	if (++kt->step == entry->macro_len)
+		return;
+	// A key released and pressed in one frame would be lost
+	if (step->len && step[1].len)
+		emit_sync(dev);
+	emit_step(dev, step + 1, 1);
+	schedule_key(kt, kt->due_ns + step[1].ms * 1000000ll);
+}
+
+/*
+ * Start the turbo or macro of a Wii key, from now
+ */
+static void start_key_timer(struct device *dev, unsigned int key) {
+	struct key_timer *kt = dev->key_timers + key;
+	const struct key_entry *entry = dev->keymap->keys + key;
+
+	wheel_del(&wheel, &kt->timer);
+	kt->timer.fire = fire_key;
+	kt->dev = dev;
+	kt->entry = entry;
+
+	if (entry->macro) {
+		kt->step = 0;
+		emit_step(dev, entry->macro, 1);
+		schedule_key(kt, timer_clock_ns() + entry->macro->ms * 1000000ll);
+	} else {
+		// The press itself was written by the caller
+		kt->on = true;
+		schedule_key(kt, timer_clock_ns() + entry->turbo_ns);
+	}
+}
+
+/*
+ * Stop every turbo and macro of a device, releasing the keys they hold if
+ * release is set
+ */
+static void cancel_key_timers(struct device *dev, int release) {
+	struct key_timer *kt;
+	int cancelled = false;
+	int i;
+
+	for (i = 0; i < XWII_KEY_NUM; ++i) {
+		kt = dev->key_timers + i;
+		if (!timer_pending(&kt->timer))
+			continue;
+		wheel_del(&wheel, &kt->timer);
+		cancelled = true;
+		if (!release)
+			continue;
+		if (kt->entry->macro)
+			emit_step(dev, kt->entry->macro + kt->step, 0);
+		else if (kt->on)
+			emit(dev, kt->entry->type, kt->entry->code, kt->entry->value[0]);
+	}
+	// Devices without timers may be freed by the reader thread
+	if (cancelled)
+		arm_timers();
+}
+
+/*
+ * Fire the timers due by now, and write what they emitted
+ */
+static void run_timers() {
+	unsigned long syncs = stats.syncs;
+	struct device *dev;
+
+	timer_now_ns = timer_clock_ns();
+	++timer_stats.wakeups;
+	wheel_advance(&wheel, (timer_now_ns - timer_epoch_ns) / TIMER_TICK_NS);
+
+	while ((dev = timer_synced)) {
+		timer_synced = dev->timer_next;
+		dev->timer_synced = false;
+		emit_sync(dev);
+	}
+	timer_stats.syncs += stats.syncs - syncs;
+	arm_timers();
+}
+
+static void dispatch_timers(struct source *source) {
+	uint64_t expirations;
+
+	// Only clears the timerfd, the wheel knows what is due
+	read(source->fd, &expirations, sizeof(expirations));
+	run_timers();
+}
+
+/*
+ * Create the timerfd driving the wheel. In threaded mode it is waited on by
+ * the emitter instead of the event loop.
+ */
+static void init_timer_source() {
+	int ret;
+
+	timer_epoch_ns = time_ns();
+	wheel_init(&wheel, 0);
+	timer_source.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (-1 == timer_source.fd)
+		w2g_error(errno, "Unable to create timer");
+	timer_source.dispatch = dispatch_timers;
+	if (threaded)
+		return;
+	ret = loop_add(&timer_source);
+	if (ret)
+		w2g_error(ret, "Unable to watch timer");
+}
+
+// Event handlers
+
+/*
+ * Filter a sample of an analog source, writing the axis only if it moved
+ */
+static inline void update_axis(struct device *dev, enum axis_source source, int32_t sample) {
+	const struct axis_entry *entry = dev->keymap->axes + source;
+	struct axis_state *state = dev->axes + source;
+	int32_t value;
+
+	if (!entry->type)
+		return;
+
+	value = axis_filter(entry, state, sample);
+	if (value != state->value) {
+		state->value = value;
+		emit(dev, entry->type, entry->code, value);
+	}
+}
+
+void handle_accel(struct device *dev, const struct xwii_event *ev) {
+	const struct xwii_event_abs *absev = &ev->v.abs[0];
+
+	update_axis(dev, AXIS_ACCEL_X, absev->x * (1 << AXIS_FRAC_BITS));
+	update_axis(dev, AXIS_ACCEL_Y, absev->y * (1 << AXIS_FRAC_BITS));
+	update_axis(dev, AXIS_ACCEL_Z, absev->z * (1 << AXIS_FRAC_BITS));
+	if (dev->keymap->axes[AXIS_ACCEL_ROLL].type)
+		update_axis(dev, AXIS_ACCEL_ROLL, tilt_angle(absev->x, absev->z));
+	if (dev->keymap->axes[AXIS_ACCEL_PITCH].type)
+		update_axis(dev, AXIS_ACCEL_PITCH, tilt_angle(absev->y, absev->z));
+
+	if (__atomic_load_n(&wanted_ifaces, __ATOMIC_RELAXED) & XWII_IFACE_MOTION_PLUS)
+		motion_accel(&dev->motion, ev);
+}
+
+/*
+ * Write a position, such as a pointer coordinate or an angle. Relative axes
+ * move by the change in position, once it has been tracked for a report.
+ */
+static inline void update_pointer(struct device *dev, enum axis_source source, float position,
+		int tracked) {
+	const struct axis_entry *entry = dev->keymap->axes + source;
+	struct axis_state *state = dev->axes + source;
+	int32_t value;
+
+	if (!entry->type)
+		return;
+
+	value = axis_scale(entry, (int64_t) (position * (1 << AXIS_FRAC_BITS)));
+	if (EV_ABS == entry->type) {
+		value = axis_clamp(entry, value);
+		if (value != state->value)
+			emit(dev, EV_ABS, entry->code, value);
+	} else if (tracked && value != state->value) {
+		emit(dev, EV_REL, entry->code, value - state->value);
+	}
+	state->value = value;
+}
+
+void handle_ir(struct device *dev, const struct xwii_event *ev) {
+	const struct axis_entry *axistable = dev->keymap->axes;
+	struct pointer_sample sample;
+	int ret;
+
+	if (!axistable[AXIS_IR_X].type && !axistable[AXIS_IR_Y].type && !axistable[AXIS_IR_ROLL].type)
+		return;
+
+	ret = pointer_update(&dev->pointer, ev, axistable + AXIS_IR_X, axistable + AXIS_IR_Y, &sample);
+	if (!ret)
+		return;
+
+	update_pointer(dev, AXIS_IR_X, sample.x, 2 == ret);
+	update_pointer(dev, AXIS_IR_Y, sample.y, 2 == ret);
+	if (sample.has_roll)
+		update_axis(dev, AXIS_IR_ROLL, sample.roll);
+}
+
+/*
+ * Write an orientation angle, in degrees. Absolute axes get it wrapped into
+ * [-180, 180], relative ones follow it across turns.
+ */
+static inline void update_angle(struct device *dev, enum axis_source source, float angle,
+		int tracked) {
+	if (EV_REL == dev->keymap->axes[source].type)
+		update_pointer(dev, source, angle, tracked);
+	else
+		update_axis(dev, source, remainderf(angle, 360) * (1 << AXIS_FRAC_BITS));
+}
+
+void handle_motion_plus(struct device *dev, const struct xwii_event *ev) {
+	struct motion_state *motion = &dev->motion;
+	int calibrated = motion->calibrated;
+	int tracked = motion->usec != 0;
+
+	motion_gyro(motion, ev);
+	if (!calibrated && motion->calibrated)
+		printf("Wiimote %d: Calibrated MotionPlus\n", dev->num);
+
+	update_angle(dev, AXIS_MP_ROLL, motion->roll, tracked);
+	update_angle(dev, AXIS_MP_PITCH, motion->pitch, tracked);
+	update_angle(dev, AXIS_MP_YAW, motion->yaw, tracked);
+}
+
+/*
+ * Convert a raw sample through the axis' calibration table
+ */
+static inline void update_lut_axis(struct device *dev, enum axis_source source, int32_t raw) {
+	const struct axis_entry *entry = dev->keymap->axes + source;
+	struct axis_state *state = dev->axes + source;
+	int32_t value;
+
+	if (!entry->type)
+		return;
+
+	if (raw < -AXIS_LUT_SIZE / 2)
+		raw = -AXIS_LUT_SIZE / 2;
+	else if (raw >= AXIS_LUT_SIZE / 2)
+		raw = AXIS_LUT_SIZE / 2 - 1;
+	value = entry->lut[raw + AXIS_LUT_SIZE / 2];
+
+	if (value != state->value) {
+		state->value = value;
+		emit(dev, EV_ABS, entry->code, value);
+	}
+}
+
+void handle_move(struct device *dev, const struct xwii_event *ev) {
+	const struct xwii_event_abs *absev = &ev->v.abs[0];
+
+	// Unless mapped, the stick is passed through
+	if (!dev->keymap->axes[AXIS_NUNCHUK_X].type && !dev->keymap->axes[AXIS_NUNCHUK_Y].type) {
+		emit(dev, EV_ABS, ABS_X, absev->x);
+		emit(dev, EV_ABS, ABS_Y, -absev->y); // Inverted
+		return;
+	}
+	update_lut_axis(dev, AXIS_NUNCHUK_X, absev->x);
+	update_lut_axis(dev, AXIS_NUNCHUK_Y, absev->y);
+}
+
+void handle_classic_move(struct device *dev, const struct xwii_event *ev) {
+	const struct xwii_event_abs *absev = ev->v.abs;
+
+	update_lut_axis(dev, AXIS_CLASSIC_LX, absev[0].x);
+	update_lut_axis(dev, AXIS_CLASSIC_LY, absev[0].y);
+	update_lut_axis(dev, AXIS_CLASSIC_RX, absev[1].x);
+	update_lut_axis(dev, AXIS_CLASSIC_RY, absev[1].y);
+	update_lut_axis(dev, AXIS_CLASSIC_LT, absev[2].x);
+	update_lut_axis(dev, AXIS_CLASSIC_RT, absev[2].y);
+}
+
+/*
+ * Combination completed by pressing key, given the held keys, or -1. The
+ * held state of the key's partners indexes a table built with the keymap.
+ */
+static inline int find_combo(const struct combo_key *ck, uint32_t held) {
+	unsigned int index = 0;
+	int i;
+
+	for (i = 0; i < ck->partners_len; ++i)
+		index |= (held >> ck->partners[i] & 1) << i;
+	return ck->combo[index] - 1;
+}
+
+/*
+ * Press the output of a combination, in place of the outputs of its keys
+ */
+static void press_combo(struct device *dev, unsigned int key, int combo) {
+	const struct combo_table *combotable = &dev->keymap->combos;
+	const struct key_entry *entry;
+	struct key_timer *kt;
+	uint32_t others = combotable->keys[combo] & ~(1u << key) & ~dev->keys_absorbed;
+	int i;
+
+	// Release what the other keys already pressed, including the step of a
+	// macro still playing
+	for (; others; others &= others - 1) {
+		i = __builtin_ctz(others);
+		entry = dev->keymap->keys + i;
+		kt = dev->key_timers + i;
+		if (entry->macro) {
+			if (timer_pending(&kt->timer)) {
+				wheel_del(&wheel, &kt->timer);
+				emit_step(dev, entry->macro + kt->step, 0);
+			}
+			continue;
+		}
+		if (entry->turbo_ns)
+			wheel_del(&wheel, &kt->timer);
+		if (entry->states & 1)
+			emit(dev, entry->type, entry->code, entry->value[0]);
+	}
+
+	dev->keys_absorbed |= combotable->keys[combo];
+	dev->combos_active |= 1u << combo;
+	entry = combotable->outputs + combo;
+	emit(dev, entry->type, entry->code, entry->value[1]);
+}
+
+/*
+ * Release the active combinations holding any of the given keys
+ */
+static void release_combos(struct device *dev, uint32_t keys) {
+	const struct combo_table *combotable = &dev->keymap->combos;
+	const struct key_entry *entry;
+	uint32_t active = dev->combos_active;
+	int i;
+
+	for (; active; active &= active - 1) {
+		i = __builtin_ctz(active);
+		if (!(combotable->keys[i] & keys))
+			continue;
+		entry = combotable->outputs + i;
+		emit(dev, entry->type, entry->code, entry->value[0]);
+		dev->combos_active &= ~(1u << i);
+	}
+}
+
+void handle_key(struct device *dev, const struct xwii_event *ev) {
+	const struct xwii_event_key *keyev = &ev->v.key;
+	const struct key_entry *entry;
+	uint32_t bit;
+	int combo;
+
+	if (keyev->code >= XWII_KEY_NUM || keyev->state >= KEY_STATE_NUM)
+		return;
+	bit = 1u << keyev->code;
+
+	if (1 == keyev->state) {
+		dev->keys_held |= bit;
+		combo = find_combo(dev->keymap->combos.by_key + keyev->code, dev->keys_held);
+		if (combo >= 0) {
+			press_combo(dev, keyev->code, combo);
+			return;
+		}
+	} else if (0 == keyev->state) {
+		dev->keys_held &= ~bit;
+		if (dev->combos_active)
+			release_combos(dev, bit);
+		// Absorbed keys were released by their combination
+		if (dev->keys_absorbed & bit) {
+			dev->keys_absorbed &= ~bit;
+			return;
+		}
+	} else if (dev->keys_absorbed & bit) {
+		return;
+	}
+
+	entry = dev->keymap->keys + keyev->code;
+	if (entry->macro) {
+		// Presses are ignored until the macro is done
+		if (1 == keyev->state && !timer_pending(&dev->key_timers[keyev->code].timer))
+			start_key_timer(dev, keyev->code);
+		return;
+	}
+	if (!(entry->states & (1u << keyev->state)))
+		return;
+
+	// A second change to the same key has to go in a new frame, or the
+	// first one is lost
+	if (dev->frame_keys & (1u << keyev->code))
+		emit_sync(dev);
+	dev->frame_keys |= 1u << keyev->code;
+
+	emit(dev, entry->type, entry->code, entry->value[keyev->state]);
+
+	if (entry->turbo_ns) {
+		if (keyev->state)
+			start_key_timer(dev, keyev->code);
+		else
+			wheel_del(&wheel, &dev->key_timers[keyev->code].timer);
+	}
+}
+
+void handle_event(struct device *dev, const struct xwii_event *ev) {
+	unsigned long writes = stats.writes;
+
+	// Watch events are recorded once the new keymap is selected
+	if (trace_file && XWII_EVENT_WATCH != ev->type)
+		record_event(ev, 0);
+
+	switch (ev->type) {
+	case XWII_EVENT_GONE:
+		// Device is gone
+		printf("Wiimote %d has disconnected\n", dev->num);
+		dev->gone = true;
+		break;
+	case XWII_EVENT_WATCH:
+		// The uinput device is about to be replaced
+		emit_sync(dev);
+		load_keymap(dev);
+		break;
+	case XWII_EVENT_NUNCHUK_MOVE:
+		handle_move(dev, ev);
+		break;
+	case XWII_EVENT_CLASSIC_CONTROLLER_MOVE:
+		handle_classic_move(dev, ev);
+		break;
+	case XWII_EVENT_ACCEL:
+		handle_accel(dev, ev);
+		break;
+	case XWII_EVENT_IR:
+		handle_ir(dev, ev);
+		break;
+	case XWII_EVENT_MOTION_PLUS:
+		handle_motion_plus(dev, ev);
+		break;
+	case XWII_EVENT_KEY:
+	case XWII_EVENT_NUNCHUK_KEY:
+	case XWII_EVENT_CLASSIC_CONTROLLER_KEY:
+		handle_key(dev, ev);
+		break;
+	}
+
+	if (stats.writes != writes)
+		++stats.reports;
+
+	// Reopening is driven by the reader, which may be another thread
+	if (__atomic_load_n(&dev->reopen_tries, __ATOMIC_RELAXED) && XWII_EVENT_WATCH != ev->type) {
+		__atomic_add_fetch(&dev->reopen_events, 1, __ATOMIC_RELAXED);
+		if (stats.writes == writes)
+			__atomic_add_fetch(&dev->reopen_dropped, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Handle the events pending on a device. In batched mode, every pending
+ * event is read and reported as a single frame.
+ */
+static void dispatch_device(struct source *source) {
+	struct device *dev = container_of(source, struct device, source);
+	struct xwii_event ev;
+	int first = true;
+	int ret;
+
+	do {
+		ret = xwii_iface_dispatch(dev->iface, &ev, sizeof(ev));
+		++stats.dispatches;
+
+		if (ret) {
+			if (-EAGAIN == ret)
+				break;
+			w2g_error(ret, "Unable to dispatch wiimote event");
+		}
+
+		if (first && measure_latency)
+			record_wakeup(&ev);
+		first = false;
+
+		++stats.events;
+		if (measure_latency)
+			dev->event = &ev;
+		handle_event(dev, &ev);
+		dev->event = NULL;
+	} while (batch_dispatch && !dev->gone);
+
+	emit_sync(dev);
+
+	if (dev->gone)
+		remove_device(dev);
+}
+
+// Threaded mode
+
+/*
+ * Queue an event for the emitter. Events are dropped while the ring is full,
+ * so that reading never waits for the output, but keymap switches, reloads,
+ * disconnections and stopping wait for room.
+ */
+static void queue_event(struct device *dev, const struct xwii_event *ev,
+		unsigned int ifaces, int64_t read_ns, int wait, struct keymaps *reloaded) {
+	struct ring_event *rev;
+
+	while (!(rev = ring_reserve(&ring))) {
+		if (!wait) {
+			__atomic_fetch_add(&pipeline.overflows, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		sched_yield();
+	}
+	hist_record(&pipeline.depth, ring_depth(&ring));
+
+	rev->dev = dev;
+	if (ev)
+		rev->ev = *ev;
+	rev->ifaces = ifaces;
+	rev->read_ns = read_ns;
+	rev->keymaps = reloaded;
+	ring_push(&ring);
+}
+
+/*
+ * Queue a keymap switch, handled in order with the events read before it
+ */
+static void queue_switch(struct device *dev, unsigned int opened_ifaces) {
+	struct xwii_event ev = { .type = XWII_EVENT_WATCH };
+
+	gettimeofday(&ev.time, NULL);
+	queue_event(dev, &ev, opened_ifaces, time_ns(), true, NULL);
+}
+
+/*
+ * Read every pending event and queue it for the emitter. Extension changes
+ * are handled here, since only this thread may use the iface, and the
+ * emitter frees the device after a disconnection.
+ */
+static void read_device(struct source *source) {
+	struct device *dev = container_of(source, struct device, source);
+	struct xwii_event ev;
+	int64_t read_ns = time_ns();
+	int first = true;
+	int ret;
+
+	for (;;) {
+		ret = xwii_iface_dispatch(dev->iface, &ev, sizeof(ev));
+		++stats.dispatches;
+
+		if (ret) {
+			if (-EAGAIN == ret)
+				break;
+			w2g_error(ret, "Unable to dispatch wiimote event");
+		}
+
+		if (first && measure_latency)
+			record_wakeup(&ev);
+		first = false;
+		++stats.events;
+
+		switch (ev.type) {
+		case XWII_EVENT_WATCH:
+			// Queues the switch once the interfaces are open
+			load_keymap(dev);
+			break;
+		case XWII_EVENT_GONE:
+			unlink_device(dev);
+			queue_event(dev, &ev, 0, read_ns, true, NULL);
+			return;
+		default:
+			queue_event(dev, &ev, 0, read_ns, false, NULL);
+			break;
+		}
+	}
+}
+
+/*
+ * Translate and write queued events. In batched mode, each frame holds the
+ * events of one read.
+ */
+static void *emit_events(void *arg) {
+	struct ring_event *rev, *next;
+	struct device *dev;
+
+	for (;;) {
+		while (!(rev = ring_peek(&ring))) {
+			ring_wait(&ring, timer_source.fd);
+			if (timers_due())
+				dispatch_timers(&timer_source);
+		}
+		dev = rev->dev;
+		if (!dev && rev->keymaps) {
+			install_keymaps(rev->keymaps, rev->read_ns);
+			ring_pop(&ring);
+			continue;
+		} else if (!dev) {
+			ring_pop(&ring);
+			break;
+		}
+
+		if (measure_latency)
+			hist_record(&pipeline.queued, (time_ns() - rev->read_ns) / 1000);
+
+		if (XWII_EVENT_WATCH == rev->ev.type) {
+			emit_sync(dev);
+			if (rev->keymaps)
+				reload_device(dev);
+			else
+				select_keymap(dev, rev->ifaces);
+		} else {
+			if (measure_latency)
+				dev->event = &rev->ev;
+			handle_event(dev, &rev->ev);
+			dev->event = NULL;
+		}
+
+		if (dev->gone) {
+			ring_pop(&ring);
+			free_device(dev);
+			continue;
+		}
+
+		next = ring_peek_next(&ring);
+		if (!batch_dispatch || !next || next->dev != dev || next->read_ns != rev->read_ns)
+			emit_sync(dev);
+		ring_pop(&ring);
+
+		// Timers aren't held back by a busy ring
+		if (timers_due())
+			run_timers();
+	}
+	return NULL;
+}
+
+static void start_emitter() {
+	int ret;
+
+	ret = pthread_create(&emitter, NULL, emit_events, NULL);
+	if (ret)
+		w2g_error(ret, "Unable to start emitter thread");
+	emitter_running = true;
+}
+
+/*
+ * Let the emitter finish the queued events and wait for it
+ */
+static void stop_emitter() {
+	queue_event(NULL, NULL, 0, 0, true, NULL);
+	pthread_join(emitter, NULL);
+	emitter_running = false;
+}
+
+// Reloading
+
+/*
+ * Read the keymap file again and install its keymaps, or keep the current
+ * ones if it can't be read. The file is parsed before anything changes, so
+ * events keep being translated with the current keymaps meanwhile.
+ */
+static void reload_keymap(int64_t start_ns) {
+	struct keymaps *reloaded;
+	unsigned int old_ifaces = wanted_ifaces;
+	struct xwii_event ev = { .type = XWII_EVENT_WATCH };
+	struct device *dev;
+	ssize_t ret;
+
+	ret = read_config(keymap_path, &reloaded);
+	if (ret) {
+		if (ret < 0)
+			w2g_warn(ret, "Unable to reload keymap");
+		else
+			fprintf(stderr, "Error reloading keymap on line %zd\n", ret);
+		fprintf(stderr, "Keeping the previous keymap\n");
+		return;
+	}
+	__atomic_store_n(&wanted_ifaces, find_wanted_ifaces(reloaded), __ATOMIC_RELAXED);
+
+	// Devices are moved in order with their events
+	if (threaded) {
+		queue_event(NULL, NULL, 0, start_ns, true, reloaded);
+		for (dev = devices; dev; dev = dev->next)
+			queue_event(dev, &ev, 0, start_ns, true, reloaded);
+	} else {
+		install_keymaps(reloaded, start_ns);
+		for (dev = devices; dev; dev = dev->next)
+			reload_device(dev);
+	}
+
+	// Sensors of newly mapped axes. Devices being reopened get them when
+	// they are next tried.
+	if (wanted_ifaces & ~old_ifaces) {
+		for (dev = devices; dev; dev = dev->next) {
+			if (!dev->reopen_tries)
+				open_ifaces(dev);
+		}
+	}
+}
+
+static void dispatch_reload(struct source *source) {
+	char buf[RELOAD_BUF_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *iev;
+	int64_t start_ns = time_ns();
+	int changed = false;
+	ssize_t len;
+	char *p;
+
+	// Saving a file may take several events, which all go in one reload
+	while ((len = read(source->fd, buf, sizeof(buf))) > 0) {
+		for (p = buf; p < buf + len; p += sizeof(*iev) + iev->len) {
+			iev = (const struct inotify_event *) p;
+			if (iev->len && !strcmp(iev->name, keymap_name))
+				changed = true;
+		}
+	}
+	if (-1 == len && EAGAIN != errno)
+		w2g_error(errno, "Unable to read keymap changes");
+
+	if (changed)
+		reload_keymap(start_ns);
+}
+
+/*
+ * Watch the keymap file for changes. Failing to is only a warning, since
+ * the keymap works without reloading.
+ */
+static void init_reload(const char *path) {
+	const char *slash = strrchr(path, '/');
+	char *dir;
+	int ret;
+
+	if (slash) {
+		dir = slash == path ? strdup("/") : strndup(path, slash - path);
+		keymap_name = slash + 1;
+	} else {
+		dir = strdup(".");
+		keymap_name = path;
+	}
+	if (!dir)
+		w2g_error(ENOMEM, "Unable to watch keymap");
+
+	reload_source.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (-1 == reload_source.fd || -1 == inotify_add_watch(reload_source.fd, dir,
+			IN_CLOSE_WRITE | IN_MOVED_TO)) {
+		w2g_warn(errno, "Unable to watch keymap, it won't be reloaded");
+		if (-1 != reload_source.fd)
+			close(reload_source.fd);
+		reload_source.fd = -1;
+		free(dir);
+		return;
+	}
+	free(dir);
+
+	reload_source.dispatch = dispatch_reload;
+	ret = loop_add(&reload_source);
+	if (ret)
+		w2g_error(ret, "Unable to watch keymap");
+}
+
+// Replay
+
+// A trace event, as sent through the event loop
+struct replay_event {
+	struct xwii_event ev;
+	unsigned int ifaces;
+};
+
+static struct {
+	struct source source;
+	int fd; // Write end
+	struct device *dev;
+} replay_pipe;
+
+static void replay_event(struct device *dev, const struct xwii_event *ev, unsigned int ifaces) {
+	// Timers run on the trace's clock
+	replay_clock_ns = ((int64_t) ev->time.tv_sec * 1000000 + ev->time.tv_usec) * 1000;
+	if (timers_due())
+		run_timers();
+
+	if (XWII_EVENT_WATCH == ev->type) {
+		emit_sync(dev);
+		select_keymap(dev, ifaces);
+	} else {
+		handle_event(dev, ev);
+	}
+	emit_sync(dev);
+}
+
+/*
+ * Read the events sent through the pipe, as xwii_iface_dispatch() reads the
+ * Wiimote
+ */
+static void dispatch_replay(struct source *source) {
+	struct replay_event batch[REPLAY_BATCH];
+	ssize_t len;
+	int i;
+
+	len = read(source->fd, batch, sizeof(batch));
+	++stats.dispatches;
+	if (-1 == len)
+		w2g_error(errno, "Unable to read replayed events");
+
+	for (i = 0; i < len / (ssize_t) sizeof(*batch); ++i) {
+		++stats.events;
+		replay_event(replay_pipe.dev, &batch[i].ev, batch[i].ifaces);
+	}
+}
+
+/*
+ * Send a report's events through the event loop and wait for their dispatch
+ */
+static void send_replay(const struct replay_event *batch, int len) {
+	int ret;
+
+	if (len * sizeof(*batch) != write(replay_pipe.fd, batch, len * sizeof(*batch)))
+		w2g_error(errno, "Unable to send replayed events");
+	ret = loop_wait(NULL);
+	++stats.polls;
+	if (ret < 0)
+		w2g_error(ret, "Unable to poll replayed events");
+}
+
+/*
+ * Feed a recorded trace through the translation code. When paced, events are
+ * replayed with their recorded spacing, otherwise as fast as possible. When
+ * looped, the events of each report are sent through a pipe and the event
+ * loop, to compare the costs of the loop backends.
+ */
+static void replay(const char *path, int paced, int looped) {
+	struct device dev = { .num = 0 };
+	struct trace trace;
+	struct xwii_event ev;
+	struct replay_event batch[REPLAY_BATCH];
+	int batch_len = 0;
+	int64_t batch_usec = 0;
+	int fds[2];
+	unsigned int ifaces;
+	unsigned long events = 0;
+	int64_t usec, first_usec = -1;
+	int64_t start, elapsed, t, translate_ns = 0;
+	struct timespec deadline;
+	int ret;
+
+	ret = trace_open(&trace, path);
+	if (ret)
+		w2g_error(ret, "Unable to open trace");
+
+	select_keymap(&dev, trace.ifaces);
+
+	if (looped) {
+		if (-1 == pipe(fds))
+			w2g_error(errno, "Unable to create replay pipe");
+		replay_pipe.source.fd = fds[0];
+		replay_pipe.source.dispatch = dispatch_replay;
+		replay_pipe.fd = fds[1];
+		replay_pipe.dev = &dev;
+		ret = loop_add(&replay_pipe.source);
+		if (ret)
+			w2g_error(ret, "Unable to poll replayed events");
+		// Each dispatch reads a whole report
+		batch_dispatch = true;
+	}
+
+	start = time_ns();
+	while (0 < (ret = trace_next(&trace, &ev, &ifaces))) {
+		usec = (int64_t) ev.time.tv_sec * 1000000 + ev.time.tv_usec;
+		if (paced) {
+			if (first_usec < 0)
+				first_usec = usec;
+			t = start + (usec - first_usec) * 1000;
+			deadline.tv_sec = t / 1000000000;
+			deadline.tv_nsec = t % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+		}
+
+		if (XWII_EVENT_GONE == ev.type)
+			break;
+
+		if (looped) {
+			// The events of a report share its timestamp
+			if (batch_len && (REPLAY_BATCH == batch_len || usec != batch_usec)) {
+				send_replay(batch, batch_len);
+				batch_len = 0;
+			}
+			batch[batch_len].ev = ev;
+			batch[batch_len++].ifaces = ifaces;
+			batch_usec = usec;
+			++events;
+			continue;
+		}
+
+		// Timing each event would cost more than translating it, so when
+		// replaying flat out only the whole run is timed
+		if (paced)
+			t = time_ns();
+		replay_event(&dev, &ev, ifaces);
+		if (paced)
+			translate_ns += time_ns() - t;
+		++events;
+	}
+	if (batch_len)
+		send_replay(batch, batch_len);
+	cancel_key_timers(&dev, true);
+	emit_sync(&dev);
+	if (looped) {
+		ret = loop_flush();
+		if (ret)
+			w2g_error(ret, "Unable to write output");
+	}
+	elapsed = time_ns() - start;
+	if (!paced)
+		translate_ns = elapsed;
+
+	trace_close(&trace);
+	if (ret < 0)
+		w2g_error(ret, "Trace is truncated");
+
+	printf("Replayed %lu events in %.3f ms\n", events, elapsed / 1e6);
+	if (events) {
+		printf("%.0f events/s, %.1f ns/event %s\n",
+				events / (elapsed / 1e9), (double) translate_ns / events,
+				looped ? "through the event loop" : "translation");
+	}
+	print_stats();
+
+	if (looped) {
+		loop_remove(&replay_pipe.source);
+		close(fds[0]);
+		close(fds[1]);
+	}
+}
+
+// Synthetic streams of the translation benchmark, one for each keymap
+static const struct bench_stream {
+	const char *name;
+	unsigned int ifaces; // Selecting the keymap
+	uint32_t keys; // Bit n is set for Wii key n
+	unsigned int key_type; // Event of the keys, but C and Z
+	unsigned int move_type; // Event of the analog samples
+} bench_streams[] = {
+	{ "Core", XWII_IFACE_CORE | XWII_IFACE_ACCEL,
+			(1u << (XWII_KEY_TWO + 1)) - 1,
+			XWII_EVENT_KEY, XWII_EVENT_ACCEL },
+	{ "Nunchuk", XWII_IFACE_CORE | XWII_IFACE_ACCEL | XWII_IFACE_NUNCHUK,
+			((1u << (XWII_KEY_TWO + 1)) - 1) | 1u << XWII_KEY_C | 1u << XWII_KEY_Z,
+			XWII_EVENT_KEY, XWII_EVENT_NUNCHUK_MOVE },
+	{ "Classic", XWII_IFACE_CORE | XWII_IFACE_CLASSIC_CONTROLLER,
+			((1u << (XWII_KEY_HOME + 1)) - 1) | ((1u << (XWII_KEY_THUMBR + 1)) - (1u << XWII_KEY_X)),
+			XWII_EVENT_CLASSIC_CONTROLLER_KEY, XWII_EVENT_CLASSIC_CONTROLLER_MOVE },
+};
+
+#define BENCH_STREAMS (sizeof(bench_streams) / sizeof(*bench_streams))
+
+static int64_t bench_usec; // Time of the next synthetic event, 1 ms apart
+
+static void bench_event(struct replay_event *rev, unsigned int type) {
+	memset(rev, 0, sizeof(*rev));
+	rev->ev.type = type;
+	rev->ev.time.tv_sec = bench_usec / 1000000;
+	rev->ev.time.tv_usec = bench_usec % 1000000;
+	bench_usec += 1000;
+}
+
+/*
+ * Press and release each of the stream's keys in turn
+ */
+static void bench_keys(const struct bench_stream *stream, struct replay_event *events, int len) {
+	unsigned int code = 0;
+	int i;
+
+	for (i = 0; i < len; ++i) {
+		if (!(i & 1)) {
+			do
+				code = (code + 1) % XWII_KEY_NUM;
+			while (!(stream->keys & (1u << code)));
+		}
+		bench_event(events + i, XWII_KEY_C == code || XWII_KEY_Z == code
+				? XWII_EVENT_NUNCHUK_KEY : stream->key_type);
+		events[i].ev.v.key.code = code;
+		events[i].ev.v.key.state = !(i & 1);
+	}
+}
+
+/*
+ * Sweep the stream's analog sources back and forth
+ */
+static void bench_moves(const struct bench_stream *stream, struct replay_event *events, int len) {
+	int i, t;
+
+	for (i = 0; i < len; ++i) {
+		bench_event(events + i, stream->move_type);
+		t = i % 128 < 64 ? i % 64 - 32 : 32 - i % 64; // -32 to 31
+		events[i].ev.v.abs[0].x = 3 * t;
+		events[i].ev.v.abs[0].y = -2 * t;
+		events[i].ev.v.abs[0].z = 100;
+		events[i].ev.v.abs[1].x = t / 2;
+		events[i].ev.v.abs[1].y = -t / 2;
+		events[i].ev.v.abs[2].x = t < 0 ? -t : t;
+		events[i].ev.v.abs[2].y = 31 - (t < 0 ? -t : t);
+	}
+}
+
+/*
+ * Plug and unplug the extension of the next stream
+ */
+static void bench_switches(const struct bench_stream *stream, struct replay_event *events,
+		int len) {
+	const struct bench_stream *other = bench_streams + (stream - bench_streams + 1) % BENCH_STREAMS;
+	int i;
+
+	for (i = 0; i < len; ++i) {
+		bench_event(events + i, XWII_EVENT_WATCH);
+		events[i].ifaces = i & 1 ? stream->ifaces : other->ifaces;
+	}
+}
+
+/*
+ * Translate events, and return the mean cost of each in ns. Switches aren't
+ * logged, which would cost more than the switch.
+ */
+static double bench_translate_events(struct device *dev, const struct replay_event *events,
+		int len) {
+	int64_t start = time_ns();
+	int i;
+
+	for (i = 0; i < len; ++i) {
+		if (XWII_EVENT_WATCH == events[i].ev.type) {
+			emit_sync(dev);
+			switch_keymap(dev, events[i].ifaces);
+			emit_sync(dev);
+		} else {
+			replay_event(dev, &events[i].ev, events[i].ifaces);
+		}
+	}
+	return (double) (time_ns() - start) / len;
+}
+
+/*
+ * Push synthetic events through the translation code with each keymap, and
+ * print the cost of each kind of event. Output goes to memory, so only the
+ * translation and the building of frames are timed.
+ */
+static void bench_translate() {
+	struct device dev = { .num = 0 };
+	const struct bench_stream *stream;
+	struct replay_event *events;
+	const struct input_event *last;
+	double keys_ns, moves_ns, switches_ns;
+	unsigned int i;
+	int ret;
+
+	events = malloc(BENCH_EVENTS * sizeof(*events));
+	if (!events)
+		w2g_error(ENOMEM, "Unable to run benchmark");
+	ret = sink_open_memory(&output);
+	if (ret)
+		w2g_error(ret, "Unable to run benchmark");
+	// There is no gamepad to recreate, so switches release the outputs
+	// instead, as with -p
+	persistent = true;
+
+	printf("Keymap      Keys    Analog  Switches (ns/event)\n");
+	for (i = 0; i < BENCH_STREAMS; ++i) {
+		stream = bench_streams + i;
+		bench_switches(stream, events, 1);
+		bench_translate_events(&dev, events, 1);
+
+		bench_keys(stream, events, BENCH_EVENTS);
+		keys_ns = bench_translate_events(&dev, events, BENCH_EVENTS);
+		bench_moves(stream, events, BENCH_EVENTS);
+		moves_ns = bench_translate_events(&dev, events, BENCH_EVENTS);
+		bench_switches(stream, events, BENCH_SWITCHES);
+		switches_ns = bench_translate_events(&dev, events, BENCH_SWITCHES);
+
+		printf("%-8s %7.1f %9.1f %9.1f\n", stream->name, keys_ns, moves_ns, switches_ns);
+	}
+	cancel_key_timers(&dev, true);
+	emit_sync(&dev);
+	free(events);
+
+	// Every frame ends in a SYN_REPORT
+	last = output.written ? sink_event(&output, output.written - 1) : NULL;
+	if (last && (EV_SYN != last->type || SYN_REPORT != last->code))
+		w2g_fail("Output doesn't end in a SYN_REPORT\n");
+	printf("Wrote %zu events in %lu frames\n", output.written, stats.syncs);
+	sink_close(&output);
+}
+
+int main(int argc, const char *argv[]) {
+	int *devnums;
+	int num_devices = 0;
+	const char *max_retries_str = NULL;
+	const char *record_path = NULL;
+	const char *replay_path = NULL;
+	const char *output_path = NULL;
+	int paced = false;
+	int compile = false;
+	int check = false;
+	int bench_translation = false;
+	const char *bench_str = NULL;
+	const char *realtime_str = NULL;
+	const char *cpu_str = NULL;
+	const char *loop_str = NULL;
+	enum loop_backend backend = LOOP_EPOLL;
+	sigset_t blockset, oldset;
+	int i;
+	int ret;
+
+	devnums = calloc(argc, sizeof(*devnums));
+
+	// Parse arguments
+	for (i = 1; i < argc; ++i) {
+		if (!strcmp("-m", argv[i])) {
+			if (keymap_path)
+				w2g_fail("Repeat option -m\n");
+			keymap_path = argv[++i];
+		} else if (!strcmp("-b", argv[i])) {
+			batch_dispatch = true;
+		} else if (!strcmp("-p", argv[i])) {
+			persistent = true;
+		} else if (!strcmp("-t", argv[i])) {
+			threaded = true;
+		} else if (!strcmp("-r", argv[i])) {
+			if (max_retries_str)
+				w2g_fail("Repeat option -r\n");
+			max_retries_str = argv[++i];
+		} else if (!strcmp("--record", argv[i])) {
+			if (record_path)
+				w2g_fail("Repeat option --record\n");
+			record_path = argv[++i];
+		} else if (!strcmp("--replay", argv[i])) {
+			if (replay_path)
+				w2g_fail("Repeat option --replay\n");
+			replay_path = argv[++i];
+		} else if (!strcmp("--paced", argv[i])) {
+			paced = true;
+		} else if (!strcmp("--compile", argv[i])) {
+			compile = true;
+		} else if (!strcmp("--check", argv[i])) {
+			check = true;
+		} else if (!strcmp("--bench-translate", argv[i])) {
+			bench_translation = true;
+		} else if (!strcmp("--bench-config", argv[i])) {
+			if (bench_str)
+				w2g_fail("Repeat option --bench-config\n");
+			bench_str = argv[++i];
+		} else if (!strcmp("--hotplug", argv[i])) {
+			hotplug = true;
+		} else if (!strcmp("--loop", argv[i])) {
+			if (loop_str)
+				w2g_fail("Repeat option --loop\n");
+			loop_str = argv[++i];
+		} else if (!strcmp("--realtime", argv[i])) {
+			if (realtime_str)
+				w2g_fail("Repeat option --realtime\n");
+			realtime_str = argv[++i];
+		} else if (!strcmp("--cpu", argv[i])) {
+			if (cpu_str)
+				w2g_fail("Repeat option --cpu\n");
+			cpu_str = argv[++i];
+		} else if (!strcmp("-o", argv[i])) {
+			if (output_path)
+				w2g_fail("Repeat option -o\n");
+			output_path = argv[++i];
+		} else {
+			devnums[num_devices++] = atoi(argv[i]);
+		}
+	}
+	if (!num_devices + !replay_path + !hotplug + !compile + !check + !bench_str
+					+ !bench_translation != 6
+			|| (record_path && 1 != num_devices)
+			|| ((persistent || threaded || realtime_str || cpu_str)
+					&& (replay_path || compile || bench_translation))
+			|| ((check || bench_str) && keymap_path)
+			|| ((check || bench_str || bench_translation) && (persistent || threaded
+					|| realtime_str || cpu_str || batch_dispatch || max_retries_str || output_path))
+			|| (loop_str && (compile || check || bench_str || bench_translation
+					|| (replay_path && paced)))
+			|| (threaded && loop_str && strcmp("epoll", loop_str)))
+		w2g_fail("Usage: wii2gamepad [-b] [-p] [-m <keymap>] [-r <max retries>] [-t | --loop <epoll|uring>]\n"
+				"                    [--realtime <priority>] [--cpu <cpu>] [--record <trace>] <wiimote number>...\n"
+				"       wii2gamepad [-b] [-p] [-m <keymap>] [-r <max retries>] [-t | --loop <epoll|uring>]\n"
+				"                    [--realtime <priority>] [--cpu <cpu>] --hotplug\n"
+				"       wii2gamepad [-m <keymap>] [-o <output>] [--paced | --loop <epoll|uring>] --replay <trace>\n"
+				"       wii2gamepad [-m <keymap>] --compile\n"
+				"       wii2gamepad [-m <keymap>] --bench-translate\n"
+				"       wii2gamepad --check < <keymap>\n"
+				"       wii2gamepad --bench-config <keymaps>\n");
+
+	if (!loop_str || !strcmp("epoll", loop_str))
+		backend = LOOP_EPOLL;
+	else if (!strcmp("uring", loop_str))
+		backend = LOOP_URING;
+	else
+		w2g_fail("Unknown event loop %s\n", loop_str);
+
+	if (check) {
+		check_keymap();
+		exit(EXIT_SUCCESS);
+	}
+
+	if (bench_str) {
+		if (atoi(bench_str) <= 0)
+			w2g_fail("Invalid number of keymaps %s\n", bench_str);
+		ret = bench_config(atoi(bench_str));
+		if (ret)
+			w2g_error(ret, "Unable to run benchmark");
+		exit(EXIT_SUCCESS);
+	}
+
+	if (!keymap_path) {
+		keymap_path = DEFAULT_KEYMAP_PATH;
+	}
+	init_keymap(keymap_path, compile);
+	wanted_ifaces = find_wanted_ifaces(keymaps);
+
+	if (compile) {
+		printf("Parsed %zu lines in %.3f ms, %.1f MB/s\n", parse_stats.lines,
+				parse_stats.ns / 1e6, parse_stats.bytes * 1e3 / (parse_stats.ns ? parse_stats.ns : 1));
+		printf("Wrote %s%s\n", keymap_path, CACHE_SUFFIX);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (bench_translation) {
+		bench_translate();
+		exit(EXIT_SUCCESS);
+	}
+
+	if (replay_path) {
+		if (output_path || loop_str) {
+			// Writes are part of the loop's cost
+			ret = sink_open_file(&output, output_path ? output_path : "/dev/null");
+			if (ret)
+				w2g_error(ret, "Unable to open output");
+		} else {
+			output.type = SINK_NULL;
+		}
+		if (loop_str) {
+			ret = loop_init(backend);
+			if (ret)
+				w2g_error(ret, "Unable to create event loop");
+			if (backend != loop_backend)
+				printf("io_uring is unavailable, using epoll\n");
+		}
+		replay(replay_path, paced, !!loop_str);
+		loop_close();
+		sink_close(&output);
+		exit(EXIT_SUCCESS);
+	}
+
+	if (max_retries_str)
+		max_retries = atoi(max_retries_str);
+
+	// Set up cleanup
+	struct sigaction sa = {
+		.sa_handler = sighandler,
+		.sa_mask = 0,
+		.sa_flags = 0
+	};
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
+
+	ret = loop_init(backend);
+	if (ret)
+		w2g_error(ret, "Unable to create event loop");
+	if (backend != loop_backend)
+		printf("io_uring is unavailable, using epoll\n");
+
+	if (threaded) {
+		ret = ring_init(&ring);
+		if (ret)
+			w2g_error(ret, "Unable to create event ring");
+	}
+	init_timer_source();
+	init_reload(keymap_path);
+
+	// Initializes the wiimotes and their evdev objects
+	if (hotplug) {
+		init_monitor();
+	}
+	for (i = 0; i < num_devices; ++i) {
+		if (!add_device(devnums[i], get_dev(devnums[i])))
+			w2g_fail("Unable to open wiimote %d\n", devnums[i]);
+	}
+	free(devnums);
+
+	if (record_path) {
+		trace_file = trace_create(record_path, xwii_iface_opened(devices->iface));
+		if (!trace_file)
+			w2g_error(errno, "Unable to create trace");
+	}
+
+	// Signals are only delivered while waiting for events
+	sigemptyset(&blockset);
+	sigaddset(&blockset, SIGINT);
+	sigaddset(&blockset, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &blockset, &oldset);
+
+	measure_latency = true;
+
+	// Started once setup is done, so that it inherits the blocked signals
+	// and doesn't race with the creation of the trace
+	if (threaded)
+		start_emitter();
+
+	// Only after init, so setup isn't slowed and everything it allocated is
+	// locked. The pin and priority only apply to the calling thread, so the
+	// emitter keeps the default policy and may run on any CPU: a slow write
+	// can't then hold off reading on a shared CPU at equal priority.
+	if (realtime_str || cpu_str) {
+		ret = realtime_init(realtime_str ? atoi(realtime_str) : 0, cpu_str ? atoi(cpu_str) : -1);
+		if (ret)
+			w2g_error(ret, "Unable to enter real time mode");
+		if (realtime_str)
+			printf("Real time priority %d", atoi(realtime_str));
+		else
+			printf("Memory locked");
+		if (cpu_str)
+			printf(" on CPU %d", atoi(cpu_str));
+		printf("\n");
+	}
+
+	printf("Running (Press Ctrl-C to terminate)\n");
+	
+	while ((devices || hotplug) && !terminate) {
+		// Wait for and handle events
+		ret = loop_wait(&oldset);
+		++stats.polls;
+		if (ret < 0 && -EINTR != ret)
+			w2g_error(ret, "Unable to poll wiimotes");
+
+		if (dump_latency) {
+			dump_latency = false;
+			print_latency();
+		}
+	}
+
+	if (emitter_running)
+		stop_emitter();
+	print_stats();
+	print_latency();
+	cleanup();
+	exit(EXIT_SUCCESS);
+}